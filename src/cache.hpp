@@ -0,0 +1,226 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "graph.hpp"
+
+// Binary cache of the reduced instance, so that reruns of the same input
+// (e.g. with different seeds) can skip buy_zero and run_all_heuristics.
+//
+// We store the graph g.orig_graph points to right after the
+// save_orig_graph() that follows the reductions, including removed edges
+// and the contraction history in edge_info. Its own orig_graph is the input
+// graph, which is not stored: loading requires the same input, checked by
+// a fingerprint. The file is native-endian and only valid for binaries
+// with the same version and record layout.
+
+#define REDUCED_CACHE_MAGIC "CUIBRED"
+#define REDUCED_CACHE_VERSION 1
+
+struct ReducedCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t edge_data_size;
+	uint32_t edge_info_size;
+
+	uint64_t fingerprint;
+
+	int32_t vertex_count;
+	int32_t edge_count;
+	uint32_t store_size;
+	uint32_t inc_size;
+	uint32_t edge_list_size;
+	uint32_t terminals_size;
+	uint32_t partial_size;
+};
+
+// FNV-1a over the input graph
+uint64_t graph_fingerprint(const Graph& g) {
+	uint64_t h = 14695981039346656037ULL;
+	const auto mix = [&](uint64_t x) {
+		for (int i = 0; i < 8; i++, x >>= 8) {
+			h ^= x & 0xff;
+			h *= 1099511628211ULL;
+		}
+	};
+
+	mix(g.vertex_count);
+	mix(g.edge_count);
+	for (auto e : g.edge_list) {
+		mix(e.source());
+		mix(e.target());
+		mix(e.weight());
+	}
+	for (auto t : g.terminals) mix(t);
+	return h;
+}
+
+void save_reduced_graph(const char *path, uint64_t fingerprint, const Graph& g) {
+	debug_printf(">>> %s\n", __func__);
+	assert(g.orig_graph);
+	const Graph& r = *g.orig_graph;
+
+	std::vector<uint32_t> inc_len, inc, edge_list, partial;
+	for (Vertex v = 0; v < r.vertex_count; v++) {
+		inc_len.push_back(r.inc_edges[v].size());
+		for (auto e : r.inc_edges[v]) inc.push_back(r.compress_edge(e).id());
+	}
+	for (auto e : r.edge_list) edge_list.push_back(r.compress_edge(e).id());
+	for (auto e : r.partial_solution) partial.push_back(r.compress_edge(e).id());
+
+	ReducedCacheHeader h;
+	memset(&h, 0, sizeof(h));
+	strcpy(h.magic, REDUCED_CACHE_MAGIC);
+	h.version = REDUCED_CACHE_VERSION;
+	h.edge_data_size = sizeof(EdgeData);
+	h.edge_info_size = sizeof(EdgeInfo);
+	h.fingerprint = fingerprint;
+	h.vertex_count = r.vertex_count;
+	h.edge_count = r.edge_count;
+	h.store_size = r.all_edge_data.size();
+	h.inc_size = inc.size();
+	h.edge_list_size = edge_list.size();
+	h.terminals_size = r.terminals.size();
+	h.partial_size = partial.size();
+
+	// write to a private file and rename it, concurrent runs may share the cache
+	std::string tmp_path = std::string(path) + ".tmp." + std::to_string(getpid());
+	FILE *f = fopen(tmp_path.c_str(), "wb");
+	if (!f) {
+		debug_printf("Cannot write cache %s\n", tmp_path.c_str());
+		return;
+	}
+
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+	for (size_t i = 0; i < r.all_edge_data.size(); i++)
+		ok = ok && fwrite(&r.all_edge_data[i], sizeof(EdgeData), 1, f) == 1;
+	const auto write_array = [&](const void *data, size_t size, size_t n) {
+		ok = ok && (n == 0 || fwrite(data, size, n, f) == n);
+	};
+	write_array(r.edge_info.data(), sizeof(EdgeInfo), r.edge_info.size());
+	write_array(r.degrees.data(), sizeof(int), r.degrees.size());
+	write_array(inc_len.data(), sizeof(uint32_t), inc_len.size());
+	write_array(inc.data(), sizeof(uint32_t), inc.size());
+	write_array(edge_list.data(), sizeof(uint32_t), edge_list.size());
+	write_array(r.terminals.data(), sizeof(Vertex), r.terminals.size());
+	write_array(partial.data(), sizeof(uint32_t), partial.size());
+
+	ok = (fclose(f) == 0) && ok;
+	if (!ok || rename(tmp_path.c_str(), path) != 0) {
+		debug_printf("Writing cache %s failed\n", path);
+		unlink(tmp_path.c_str());
+	}
+}
+
+// Turns the freshly read input graph g into the reduced graph stored in the
+// cache, as if the reductions and save_orig_graph() had just been run.
+// Returns false (and leaves g untouched) if there is no usable cache.
+bool load_reduced_graph(const char *path, uint64_t fingerprint, Graph& g) {
+	debug_printf(">>> %s\n", __func__);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ReducedCacheHeader)) {
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return false;
+
+	const char *p = (const char*)map;
+	const char *end = p + st.st_size;
+	ReducedCacheHeader h;
+	memcpy(&h, p, sizeof(h));
+	p += sizeof(h);
+
+	size_t expected = sizeof(h) + (size_t)h.store_size * (sizeof(EdgeData) + sizeof(EdgeInfo)) +
+		(size_t)h.vertex_count * (sizeof(int) + sizeof(uint32_t)) +
+		((size_t)h.inc_size + h.edge_list_size + h.partial_size) * sizeof(uint32_t) +
+		(size_t)h.terminals_size * sizeof(Vertex);
+
+	if (memcmp(h.magic, REDUCED_CACHE_MAGIC, sizeof(REDUCED_CACHE_MAGIC)) != 0 ||
+		h.version != REDUCED_CACHE_VERSION || h.edge_data_size != sizeof(EdgeData) ||
+		h.edge_info_size != sizeof(EdgeInfo) || h.fingerprint != fingerprint ||
+		expected != (size_t)(end - (const char*)map)) {
+		debug_printf("Cache %s does not match the input, ignoring it\n", path);
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	const auto read_array = [&](auto *data, size_t n) {
+		memcpy(data, p, n * sizeof(*data));
+		p += n * sizeof(*data);
+	};
+	std::vector<uint32_t> buff;
+
+	g.vertex_count = h.vertex_count;
+	g.edge_count = h.edge_count;
+
+	g.all_edge_data.clear();
+	for (uint32_t i = 0; i < h.store_size; i++) {
+		EdgeData d;
+		read_array(&d, 1);
+		g.all_edge_data.push_back(d);
+	}
+	g.edge_info.resize(h.store_size);
+	read_array(g.edge_info.data(), h.store_size);
+
+	g.degrees.resize(g.vertex_count);
+	read_array(g.degrees.data(), g.vertex_count);
+
+	std::vector<uint32_t> inc_len(g.vertex_count);
+	read_array(inc_len.data(), g.vertex_count);
+	g.inc_edges.assign(g.vertex_count, incidence_list_t());
+	for (Vertex v = 0; v < g.vertex_count; v++) {
+		buff.resize(inc_len[v]);
+		read_array(buff.data(), buff.size());
+		for (auto x : buff) g.inc_edges[v].push_back(g.decompress_edge(x));
+	}
+
+	buff.resize(h.edge_list_size);
+	read_array(buff.data(), buff.size());
+	g.edge_list.clear();
+	g.max_weight = 0;
+	for (auto x : buff) {
+		g.edge_list.push_back(g.decompress_edge(x));
+		g.max_weight = std::max(g.max_weight, g.edge_list.back().weight());
+	}
+
+	g.clear_dirty();
+
+	std::vector<Vertex> terminals(h.terminals_size);
+	read_array(terminals.data(), terminals.size());
+	g.terminals.clear();
+	g.terminal_count = 0;
+	g.terminal_mask.assign(g.vertex_count, false);
+	for (auto t : terminals) g.mark_terminal(t);
+
+	buff.resize(h.partial_size);
+	read_array(buff.data(), buff.size());
+	g.partial_solution.clear();
+	for (auto x : buff) g.partial_solution.push_back(g.decompress_edge(x));
+
+	assert(p == end);
+	munmap(map, st.st_size);
+
+	// the stored graph is reduced, there is nothing to look at again
+	g.clear_dirty();
+
+	g.save_orig_graph();
+	return true;
+}
+
+#endif // CACHE_HPP
@@ -0,0 +1,167 @@
+#ifndef CSR_HPP
+#define CSR_HPP
+#ifndef GRAPH_HPP
+#error "csr.hpp must be included from graph.hpp!"
+#endif
+
+#include "magic_constants.hpp"
+
+// Read-only compressed sparse row snapshot of a Graph.
+//
+// Incidences of vertex v live in [offsets[v], offsets[v + 1]) of the flat
+// targets/weights arrays (sorted by target, like Graph::inc_edges) and
+// edges[] maps every slot back to the Edge it was made from. Terminal
+// marks are read from the underlying graph, so (un)marking terminals is
+// fine, but the snapshot must be rebuilt after any edge is added, removed
+// or contracted.
+struct CSRGraph {
+	struct Arc {
+		const CSRGraph* g;
+		unsigned i;
+		Vertex s;
+
+		Vertex source() const { return s; }
+		Vertex target() const { return g->targets[i]; }
+		Weight weight() const { return g->weights[i]; }
+		operator Edge() const { return g->edges[i]; }
+	};
+
+	struct ArcIterator {
+		Arc a;
+
+		const Arc& operator*() const { return a; }
+		ArcIterator& operator++() { a.i++; return *this; }
+		bool operator!=(const ArcIterator& rhs) const { return a.i != rhs.a.i; }
+		bool operator==(const ArcIterator& rhs) const { return a.i == rhs.a.i; }
+	};
+
+	struct ArcRange {
+		ArcIterator b, e;
+
+		ArcIterator begin() const { return b; }
+		ArcIterator end() const { return e; }
+		size_t size() const { return e.a.i - b.a.i; }
+	};
+
+	const Graph& graph;
+	const int vertex_count;
+	const std::vector<Vertex>& terminals;
+	const std::vector<char>& terminal_mask;
+	const std::vector<Edge>& edge_list;
+	Weight max_weight;
+
+	std::vector<unsigned> offsets;
+	std::vector<Vertex> targets;
+	std::vector<Weight> weights;
+	std::vector<Edge> edges;
+
+	explicit CSRGraph(const Graph& g);
+
+	bool is_terminal(Vertex v) const { return terminal_mask[v]; }
+	int degree(Vertex v) const { return offsets[v + 1] - offsets[v]; }
+
+	ArcRange arcs(Vertex v) const {
+		return { { { this, offsets[v], v } }, { { this, offsets[v + 1], v } } };
+	}
+
+	CompressedEdge compress_edge(Edge e) const { return graph.compress_edge(e); }
+	Edge decompress_edge(CompressedEdge ce) const { return graph.decompress_edge(ce); }
+};
+
+CSRGraph::CSRGraph(const Graph& g) : graph(g), vertex_count(g.vertex_count),
+	terminals(g.terminals), terminal_mask(g.terminal_mask), edge_list(g.edge_list),
+	max_weight(0) {
+
+	offsets.resize(vertex_count + 1);
+	offsets[0] = 0;
+	for (Vertex v = 0; v < vertex_count; v++)
+		offsets[v + 1] = offsets[v] + g.inc_edges[v].size();
+
+	targets.reserve(offsets[vertex_count]);
+	weights.reserve(offsets[vertex_count]);
+	edges.reserve(offsets[vertex_count]);
+	for (Vertex v = 0; v < vertex_count; v++) {
+		for (auto e : g.inc_edges[v]) {
+			targets.push_back(e.target());
+			weights.push_back(e.weight());
+			max_weight = std::max(max_weight, e.weight());
+			edges.push_back(e);
+		}
+	}
+}
+
+// uniform access to incidences for algorithms templated on the graph type
+const incidence_list_t& incident_edges(const Graph& g, Vertex v) {
+	return g.inc_edges[v];
+}
+CSRGraph::ArcRange incident_edges(const CSRGraph& g, Vertex v) {
+	return g.arcs(v);
+}
+
+// position of the edge from v to its neighbour u among the incidences of v,
+// and back
+int incidence_slot(const Graph& g, Vertex v, Vertex u) {
+	return g.inc_edges[v].rank(u);
+}
+int incidence_slot(const CSRGraph& g, Vertex v, Vertex u) {
+	const Vertex* t = g.targets.data();
+	return std::lower_bound(t + g.offsets[v], t + g.offsets[v + 1], u) - (t + g.offsets[v]);
+}
+Edge incidence_at(const Graph& g, Vertex v, int slot) {
+	return g.inc_edges[v][slot];
+}
+Edge incidence_at(const CSRGraph& g, Vertex v, int slot) {
+	return g.edges[g.offsets[v] + slot];
+}
+
+// Calls f(i, j) for the slots i of u and j of v with targets[i] == targets[j]
+// in increasing order of target, until f returns true. Lists of similar
+// length are merged in blocks of 4x4 all-pairs compares (which the compiler
+// vectorizes), a list CONST_GALLOP_RATIO times shorter than the other one
+// gallops through it instead. Returns whether f returned true.
+template < typename F >
+bool for_common_targets(const CSRGraph& g, Vertex u, Vertex v, F f) {
+	const Vertex* t = g.targets.data();
+	unsigned i = g.offsets[u], i_end = g.offsets[u + 1];
+	unsigned j = g.offsets[v], j_end = g.offsets[v + 1];
+
+	bool swapped = (i_end - i) > (j_end - j);
+	if (swapped) { std::swap(i, j); std::swap(i_end, j_end); }
+	const auto report = [&](unsigned a, unsigned b) {
+		return swapped ? f(b, a) : f(a, b);
+	};
+
+	if ((i_end - i) * CONST_GALLOP_RATIO < j_end - j) {
+		for (; i < i_end; i++) {
+			unsigned step = 1;
+			while (j + step < j_end && t[j + step] < t[i]) step *= 2;
+			j = std::lower_bound(t + j + step / 2, t + std::min(j + step, j_end), t[i]) - t;
+			if (j == j_end) break;
+			if (t[j] == t[i] && report(i, j)) return true;
+		}
+		return false;
+	}
+
+	while (i + 4 <= i_end && j + 4 <= j_end) {
+		unsigned mask = 0;
+		for (int a = 0; a < 4; a++)
+			for (int b = 0; b < 4; b++)
+				mask |= unsigned(t[i + a] == t[j + b]) << (4 * a + b);
+		for (; mask; mask &= mask - 1) {
+			int bit = __builtin_ctz(mask);
+			if (report(i + bit / 4, j + bit % 4)) return true;
+		}
+		Vertex a_max = t[i + 3], b_max = t[j + 3];
+		i += 4 * (a_max <= b_max);
+		j += 4 * (b_max <= a_max);
+	}
+	while (i < i_end && j < j_end) {
+		if (t[i] == t[j] && report(i, j)) return true;
+		Vertex a = t[i], b = t[j];
+		i += a <= b;
+		j += b <= a;
+	}
+	return false;
+}
+
+#endif // CSR_HPP
@@ -9,9 +9,9 @@
 
 #define rand() better_rand()
 
-std::mt19937_64 _rand_gen(0);
+thread_local std::mt19937_64 _rand_gen(0);
 int better_rand() {
-  static std::uniform_int_distribution<int> dist{0, std::numeric_limits<int>::max()};
+  static thread_local std::uniform_int_distribution<int> dist{0, std::numeric_limits<int>::max()};
   return dist(_rand_gen);
 }
 
@@ -67,7 +67,7 @@ long long MyTimer::end;
   } while (0)
 
 
-bool print_debug = true;
+thread_local bool print_debug = true;
 
 // suppress debug output for a single statement
 #define PAUSE_DEBUG \
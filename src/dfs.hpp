@@ -4,7 +4,11 @@
 #error "dfs.hpp must be included from graph.hpp!"
 #endif
 
+#include <type_traits>
+#include <utility>
+
 #include "boost/graph/depth_first_search.hpp"
+#include "magic_constants.hpp"
 
 template < typename Backtrack, typename NonTreeEdge >
 struct _dfs_visitor : boost::dfs_visitor<> {
@@ -122,6 +126,299 @@ struct Heap {
 };
 
 
+// Priority queue for Dijkstra with non-negative integer keys, which are read
+// through key(x) at push time. Monotone: no key below the last popped one may
+// be pushed while the queue is nonempty. A push of an element already in the queue (decrease) adds
+// another entry; outdated entries are skipped when popped. map[x] tells
+// whether x is in the queue, as in Heap.
+//
+// Given max_weight (the largest edge weight of the searched graph, -1 if
+// unknown) of at most CONST_DIAL_MAX_WEIGHT, keys are kept in a ring of
+// max_weight + 1 buckets (Dial's algorithm). Otherwise, or as soon as a key
+// does not fit the ring (e.g. multi-source searches with arbitrary initial
+// distances), it is a radix heap with a bucket per highest bit of key ^ last.
+template < typename T, typename KeyFn, typename IndexMap >
+struct MonotoneHeap {
+	IndexMap map;
+	KeyFn key;
+
+	typedef typename IndexMap::value_type Index;
+	enum : Index { not_in_heap = std::numeric_limits<Index>::max(), in_heap = 0 };
+
+	MonotoneHeap(KeyFn k, Weight max_weight = -1) : key(k) {
+		if (max_weight >= 0 && max_weight <= CONST_DIAL_MAX_WEIGHT)
+			ring.resize(max_weight + 1);
+		dial = !ring.empty();
+	}
+
+	void push(const T& x) {
+		unsigned k = key(x);
+		// Outdated entries left in an empty queue sit where they belong
+		// relative to last, so a search can go on around them; they are
+		// swept away only when a new search starts below last. With none
+		// left, the queue starts over at k. Until the next pop, pushes
+		// below last move it down again.
+		if (live == 0) {
+			if (k < last) clear();
+			fresh = true;
+			top = k;
+			behind = entries > 0;
+			if (!behind) {
+				dial = !ring.empty();
+				cursor = 0;
+				last = k;
+			}
+		}
+		if (fresh) {
+			if (k < last) _lower_last(k);
+			top = std::max(top, k);
+		}
+		assert(k >= last);
+
+		if (map[x] == not_in_heap) {
+			map[x] = in_heap;
+			live++;
+		}
+
+		if (dial) {
+			if (k - last < ring.size()) {
+				size_t i = cursor + (k - last);
+				ring[i < ring.size() ? i : i - ring.size()].push_back({k, x});
+				entries++;
+				return;
+			}
+			_ring_to_radix();
+		}
+		radix[_radix_bucket(k)].push_back({k, x});
+		entries++;
+	}
+
+	T pop() {
+		assert(live > 0);
+		fresh = false;
+		if (dial) {
+			while (true) {
+				auto& b = ring[cursor];
+				while (!b.empty()) {
+					Entry e = b.back();
+					b.pop_back();
+					entries--;
+					if (!_stale(e)) return _take(e);
+				}
+				if (++cursor == ring.size()) cursor = 0;
+				last++;
+			}
+		}
+
+		while (true) {
+			auto& b = radix[0];
+			while (!b.empty()) {
+				Entry e = b.back();
+				b.pop_back();
+				entries--;
+				if (!_stale(e)) return _take(e);
+			}
+
+			// the first nonempty bucket holds the minimum, make it
+			// the new last and redistribute the bucket below
+			int i = 1;
+			while (radix[i].empty()) i++;
+			unsigned min_key = std::numeric_limits<unsigned>::max();
+			for (auto e : radix[i])
+				if (!_stale(e) && e.key < min_key) min_key = e.key;
+			if (min_key != std::numeric_limits<unsigned>::max()) last = min_key;
+			_redistribute(radix[i]);
+		}
+	}
+
+	bool empty() const { return live == 0; }
+
+	// Fills the empty queue with xs (repeats allowed) in linear time. Buckets
+	// are laid out from the smallest key, so a search seeded with arbitrary
+	// distances can stay in the ring if their spread allows.
+	template < typename Range >
+	void build(const Range& xs) {
+		assert(live == 0);
+		clear();
+		unsigned min_key = std::numeric_limits<unsigned>::max(), max_key = 0;
+		for (const T& x : xs) {
+			unsigned k = key(x);
+			min_key = std::min(min_key, k);
+			max_key = std::max(max_key, k);
+		}
+		if (min_key > max_key) return;
+
+		last = min_key;
+		dial = max_key - min_key < ring.size();
+		for (const T& x : xs) {
+			unsigned k = key(x);
+			if (map[x] == not_in_heap) {
+				map[x] = in_heap;
+				live++;
+			}
+			(dial ? ring[k - last] : radix[_radix_bucket(k)]).push_back({k, x});
+			entries++;
+		}
+	}
+
+	// removes all elements, cheaper than popping them
+	void clear() {
+		if (entries > 0) {
+			for (auto& b : radix) _clear_bucket(b);
+			for (auto& b : ring) _clear_bucket(b);
+			entries = 0;
+		}
+		_reset();
+	}
+
+private:
+	struct Entry {
+		unsigned key;
+		T x;
+	};
+
+	std::vector<Entry> radix[33];
+	std::vector< std::vector<Entry> > ring;
+	bool dial;
+	size_t cursor = 0;
+	unsigned last = 0;
+	// nothing was popped since the queue ran empty, so keys below last may
+	// still come; top is the largest key pushed since, behind tells whether
+	// outdated entries from before are left
+	bool fresh = false;
+	bool behind = false;
+	unsigned top = 0;
+	size_t live = 0;
+	// all entries, outdated ones included
+	size_t entries = 0;
+
+	bool _stale(const Entry& e) { return map[e.x] == not_in_heap || (unsigned)key(e.x) != e.key; }
+
+	int _radix_bucket(unsigned k) const { return k == last ? 0 : 32 - __builtin_clz(k ^ last); }
+
+	T _take(const Entry& e) {
+		map[e.x] = not_in_heap;
+		last = e.key;
+		live--;
+		return e.x;
+	}
+
+	// moves the live entries of b to the radix buckets they belong to
+	void _redistribute(std::vector<Entry>& b) {
+		entries -= b.size();
+		for (auto e : b) {
+			if (_stale(e)) continue;
+			radix[_radix_bucket(e.key)].push_back(e);
+			entries++;
+		}
+		b.clear();
+	}
+
+	// Makes k the new last while nothing was popped. If all entries are from
+	// the current search, their keys are in [last, top] and the ring just
+	// turns back as long as they fit. Otherwise the live entries are laid out
+	// again, in the ring from k if they fit, or in radix buckets from key 0,
+	// which no key can go below.
+	void _lower_last(unsigned k) {
+		if (dial && !behind && top - k < ring.size()) {
+			size_t d = last - k;
+			cursor = cursor >= d ? cursor - d : cursor + ring.size() - d;
+			last = k;
+			return;
+		}
+
+		std::vector<Entry> all;
+		const auto take_all = [&](std::vector<Entry>& b) {
+			for (auto e : b) if (!_stale(e)) all.push_back(e);
+			b.clear();
+		};
+		for (auto& b : ring) take_all(b);
+		for (auto& b : radix) take_all(b);
+		behind = false;
+		entries = all.size();
+		cursor = 0;
+		dial = !ring.empty() && top - k < ring.size();
+		last = dial ? k : 0;
+		for (auto e : all)
+			(dial ? ring[e.key - last] : radix[_radix_bucket(e.key)]).push_back(e);
+	}
+
+	void _ring_to_radix() {
+		if (entries > 0)
+			for (auto& b : ring) _redistribute(b);
+		dial = false;
+	}
+
+	void _clear_bucket(std::vector<Entry>& b) {
+		for (auto e : b) map[e.x] = not_in_heap;
+		b.clear();
+	}
+
+	void _reset() {
+		live = 0;
+		last = 0;
+		cursor = 0;
+		fresh = false;
+		dial = !ring.empty();
+	}
+};
+
+// MonotoneHeap over vertices keyed by dist[], for g's weights
+template < typename G, typename DistMap >
+auto make_dijkstra_heap(const G& g, const DistMap& dist) {
+	const auto key = [&dist](Vertex v) { return dist[v]; };
+	MonotoneHeap<Vertex, decltype(key), std::vector<unsigned>> heap(key, g.max_weight);
+	heap.map.assign(g.vertex_count, heap.not_in_heap);
+	return heap;
+}
+
+
+// Scratch state for many searches on one graph. Distances start at infinity
+// and reset() restores only the entries of vertices pushed since the last
+// reset, so a search costs what it explores rather than O(|V|). It serves
+// as the heap argument of Dijkstra (together with dist); sources are added
+// by add_source. The graph may lose or gain edges between searches, as long
+// as the vertex count stays.
+struct DijkstraWorkspace {
+	struct Key {
+		const std::vector<Weight>* dist;
+		Weight operator()(Vertex v) const { return (*dist)[v]; }
+	};
+
+	std::vector<Weight> dist;
+	// every push is recorded, repeats included
+	std::vector<Vertex> touched;
+	MonotoneHeap<Vertex, Key, std::vector<unsigned>> heap;
+
+	template < typename G >
+	explicit DijkstraWorkspace(const G& g) :
+		dist(g.vertex_count, std::numeric_limits<Weight>::max()),
+		heap(Key{&dist}, g.max_weight) {
+		heap.map.assign(g.vertex_count, heap.not_in_heap);
+	}
+	DijkstraWorkspace(const DijkstraWorkspace&) = delete;
+	DijkstraWorkspace& operator=(const DijkstraWorkspace&) = delete;
+
+	void add_source(Vertex v, Weight d = 0) {
+		dist[v] = d;
+		push(v);
+	}
+
+	void push(Vertex v) {
+		touched.push_back(v);
+		heap.push(v);
+	}
+	Vertex pop() { return heap.pop(); }
+	bool empty() const { return heap.empty(); }
+
+	void reset() {
+		for (auto v : touched) dist[v] = std::numeric_limits<Weight>::max();
+		touched.clear();
+		heap.clear();
+	}
+};
+
+
 struct Dummy {
 	template < typename ... Args > void operator() (Args...) const {}
 	template < typename T > Dummy operator[](const T&) const { return Dummy(); }
@@ -129,15 +426,37 @@ struct Dummy {
 };
 const Dummy dummy;
 
-template < typename DistMap, typename PredMap, typename Heap,
+// What Dijkstra does after popping a vertex: go on, stop the whole search
+// right away, or go on without relaxing the edges of the popped vertex.
+enum class Visit { Continue, Stop, Prune };
+
+// vertex visitors may return Visit or nothing (meaning Continue)
+template < typename F >
+typename std::enable_if<std::is_void<decltype(std::declval<F&>()(Vertex()))>::value, Visit>::type
+_visit_vertex(F& f, Vertex v) {
+	f(v);
+	return Visit::Continue;
+}
+
+template < typename F >
+typename std::enable_if<!std::is_void<decltype(std::declval<F&>()(Vertex()))>::value, Visit>::type
+_visit_vertex(F& f, Vertex v) {
+	return f(v);
+}
+
+// G is either Graph or its read-only CSRGraph snapshot. A stopped search
+// leaves the heap nonempty; DijkstraWorkspace::reset takes care of that.
+template < typename G, typename DistMap, typename PredMap, typename Heap,
 	class VertexPopped = Dummy, class EdgeRelaxed = Dummy, class EdgeNotRelaxed = Dummy >
-void Dijkstra(const Graph& g, DistMap& dist, PredMap& pred, Heap& heap,
+void Dijkstra(const G& g, DistMap& dist, PredMap& pred, Heap& heap,
 	VertexPopped vp = {}, EdgeRelaxed er = {}, EdgeNotRelaxed enr = {}) {
 	while (!heap.empty()) {
 		Vertex v = heap.pop();
-		vp(v);
+		Visit visit = _visit_vertex(vp, v);
+		if (visit == Visit::Stop) return;
+		if (visit == Visit::Prune) continue;
 
-		for (auto e : g.inc_edges[v]) {
+		for (auto e : incident_edges(g, v)) {
 			Vertex u = e.target();
 			if (dist[v] + e.weight() < dist[u]) {
 				dist[u] = dist[v] + e.weight();
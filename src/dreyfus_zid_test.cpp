@@ -0,0 +1,70 @@
+// the parallel evaluation only shows up with more than one thread
+#define CONST_THREAD_COUNT 4
+#include "magic_constants.hpp"
+
+#include <stdio.h>
+#include <signal.h>
+#include <random>
+
+#include "graph.hpp"
+#include "heuristics.hpp"
+
+volatile sig_atomic_t g_stop_signal = 0;
+
+// Runs dreyfus_zid on the structure of a greedy solution of random graphs,
+// once on one thread and once on four, and checks that both give the same
+// weight and a tree of that weight connecting all terminals.
+
+bool connects_terminals(const Graph& g, const std::vector<Edge>& sol) {
+	UnionFind uf(g.vertex_count);
+	for (auto e : sol) uf.link(e.source(), e.target());
+	for (auto t : g.terminals)
+		if (!uf.find(t, g.terminals[0])) return false;
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	int runs = argc > 1 ? atoi(argv[1]) : 500;
+	std::mt19937 rng(1);
+	_rand_gen = std::mt19937_64(1);
+	print_debug = false;
+	int failed = 0;
+
+	for (int run = 0; run < runs; run++) {
+		// every tenth graph has a hub, whose preds don't fit in a byte
+		const bool hub = run % 10 == 0;
+		int n = hub ? 300 + rng() % 200 : 4 + rng() % 60;
+		Graph g(n);
+		std::vector<OriginalEdge> edges;
+		for (int v = 1; v < n; v++) edges.emplace_back(hub ? 0 : rng() % v, v, 1 + rng() % 20);
+		for (int i = 0; i < n; i++) {
+			int s = rng() % n, t = rng() % n;
+			// large weights need the full width distances
+			edges.emplace_back(s, t, 1 + rng() % (run % 2 ? 20 : 40000));
+		}
+		g.add_edges(edges);
+		int k = 2 + rng() % std::min(n - 1, 10);
+		while (g.terminal_count < k) g.mark_terminal(rng() % n);
+
+		std::vector<Edge> approx;
+		greedy_2approx(g, std::back_inserter(approx));
+		Weight bound = clean_up_solution(g, approx, std::back_inserter(g.partial_solution));
+		auto S = get_solution_structure(g);
+
+		const CSRGraph csr(g);
+		std::vector<Edge> sol1, sol4;
+		Weight w1 = dreyfus_zid(csr, S, std::back_inserter(sol1), bound, 1);
+		Weight w4 = dreyfus_zid(csr, S, std::back_inserter(sol4), bound, 4);
+
+		Weight sum = 0;
+		for (auto e : sol4) sum += e.weight();
+		if (w1 != w4 || w4 > bound || sum != w4 || !connects_terminals(g, sol4)) {
+			printf("run %d: %d vertices, %d terminals: weight %d on 1 thread, %d on 4, bound %d\n",
+				run, n, k, w1, w4, bound);
+			failed++;
+		}
+	}
+
+	printf("%d of %d runs failed\n", failed, runs);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -5,21 +5,25 @@
 #include <list>
 #include <limits>
 #include <vector>
-#include <deque>
+#include <array>
 #include <algorithm>
 #include <cassert>
 #include <memory>
+#include <cstring>
 
 #include "boost/iterator/counting_iterator.hpp"
 #include "boost/graph/graph_traits.hpp"
 
 #include "debug.hpp"
+#include "magic_constants.hpp"
 
 //forward declarations
 struct Edge;
 struct EdgeData;
+struct EdgeInfo;
 struct WeightMap;
 struct Graph;
+struct BoundedTerminalSearch;
 
 
 typedef int Vertex;
@@ -27,8 +31,8 @@ typedef int Weight;
 
 typedef std::tuple<Vertex, Vertex, Weight> OriginalEdge;
 typedef std::vector< OriginalEdge > edge_history_t;
-typedef std::vector<Edge> incidence_list_t;
-typedef std::vector<Edge>::const_iterator incidence_iterator;
+class IncidenceList;
+typedef IncidenceList incidence_list_t;
 
 enum {
 	EDGE_REF_OFFSET = 10,
@@ -36,40 +40,70 @@ enum {
 	EDGE_NO_EDGE = -3
 };
 
+// Fields read by the search loops; kept to 16 bytes so that four records
+// share a cache line. Everything else lives in EdgeInfo.
 struct EdgeData {
-	bool removed;
-
 	Vertex s;
 	Vertex t;
 
 	int weight;
+	unsigned edge_index : 31;
+	bool removed : 1;
+};
+
+// Bookkeeping fields of an edge, indexed by EdgeData::edge_index.
+struct EdgeInfo {
 	unsigned edge_list_pos;
 	int orig_edge_1, orig_edge_2;
-	int edge_index;
 
 	int successor_index;
 };
 
+// Chunked array of EdgeData. Records never move once stored (Edge keeps a
+// pointer to them) and copying the store is a memcpy per chunk.
+class EdgeStore {
+	enum { CHUNK_BITS = 12, CHUNK_SIZE = 1 << CHUNK_BITS };
+
+	std::vector< std::unique_ptr<EdgeData[]> > chunks;
+	size_t count;
+
+public:
+	EdgeStore() : count(0) {}
+	EdgeStore(const EdgeStore& s) : count(s.count) {
+		chunks.resize(s.chunks.size());
+		for (size_t i = 0; i < chunks.size(); i++) {
+			chunks[i].reset(new EdgeData[CHUNK_SIZE]);
+			size_t len = std::min(count - (i << CHUNK_BITS), (size_t)CHUNK_SIZE);
+			memcpy(chunks[i].get(), s.chunks[i].get(), len * sizeof(EdgeData));
+		}
+	}
+	EdgeStore& operator =(const EdgeStore&) = delete;
+
+	size_t size() const { return count; }
+
+	EdgeData& operator[](size_t i) { return chunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)]; }
+	const EdgeData& operator[](size_t i) const {
+		return chunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)];
+	}
+	EdgeData& back() { return (*this)[count - 1]; }
+
+	void clear() {
+		chunks.clear();
+		count = 0;
+	}
+
+	void push_back(const EdgeData& d) {
+		if ((count & (CHUNK_SIZE - 1)) == 0) chunks.emplace_back(new EdgeData[CHUNK_SIZE]);
+		(*this)[count++] = d;
+	}
+};
+
 struct Edge {
 	Vertex source() const;
 	Vertex target() const;
-	Vertex orig_source() const {
-		assert(edge_data()->orig_edge_1 >= 0);
-		return edge_data()->orig_edge_1;
-	}
-	Vertex orig_target() const {
-		EdgeData *d = edge_data();
-		Assert(d->orig_edge_2 >= 0 && d->orig_edge_1 >= 0, "%d %d (%d, %d, %d)",
-			d->s, d->t, d->weight, d->orig_edge_1, d->orig_edge_2);
-		return d->orig_edge_2;
-	}
 
 	int weight() const;
-	int orig_edge() const {
-		EdgeData *d = edge_data();
-		Assert(d->orig_edge_1 == EDGE_EXT_REF, "%d %d\n", d->orig_edge_1, d->orig_edge_2);
-		return d->orig_edge_2;
-	}
+	int index() const { return edge_data()->edge_index; }
 
 	bool is_removed() const { return edge_data()->removed; }
 
@@ -94,8 +128,9 @@ struct Edge {
 	friend struct Graph;
 	friend void print_graph(FILE* out, const Graph& g);
 	friend Edge get_null_edge();
-	friend incidence_list_t _merge_inc_list(incidence_list_t* a, incidence_list_t* b, std::vector<Edge>& to_remove);
-	friend bool test_edge(Graph& g, Edge e, int threshold);
+	friend incidence_list_t _merge_inc_list(incidence_list_t* a, incidence_list_t* b,
+		std::vector<Edge>& to_remove, std::vector<EdgeInfo>& edge_info);
+	friend bool test_edge(Graph& g, Edge e, int threshold, BoundedTerminalSearch& search);
 private:
 	uintptr_t ptr;
 
@@ -113,12 +148,202 @@ class CompressedEdge {
 	bool is_null() const {
 		return x == std::numeric_limits<unsigned>::max();
 	}
+	unsigned id() const { return x; }
 };
 
+// incidence lists are sorted by target, so all lookups are binary searches
+bool _target_less(Edge e, Vertex t) { return e.target() < t; }
+bool _less_target(Vertex t, Edge e) { return t < e.target(); }
+
+// Incidences of one vertex, sorted by target. A list is a plain vector
+// until it grows past CONST_HUB_DEGREE edges; then it is cut into sorted
+// chunks of about CHUNK edges, indexed by their last target. A hub finds
+// an edge in O(log d) and inserts or removes one by moving O(CHUNK + d /
+// CHUNK) entries instead of O(d). Iteration is in target order either way.
+class IncidenceList {
+public:
+	enum { CHUNK = CONST_HUB_DEGREE / 4 };
+
+private:
+	std::vector<Edge> flat;
+	// nonempty only for hubs, and then no chunk is empty
+	std::vector< std::vector<Edge> > chunks;
+	size_t count;
+
+public:
+	struct const_iterator {
+		typedef std::forward_iterator_tag iterator_category;
+		typedef Edge value_type;
+		typedef ptrdiff_t difference_type;
+		typedef const Edge* pointer;
+		typedef const Edge& reference;
+
+		const Edge* p;
+		const Edge* p_end;
+		// chunks after the one p points into
+		const std::vector<Edge>* next;
+		const std::vector<Edge>* next_end;
+
+		reference operator*() const { return *p; }
+		pointer operator->() const { return p; }
+		const_iterator& operator++() {
+			if (++p == p_end && next != next_end) {
+				p = next->data();
+				p_end = p + next->size();
+				++next;
+			}
+			return *this;
+		}
+		const_iterator operator++(int) {
+			const_iterator it = *this;
+			++*this;
+			return it;
+		}
+		bool operator==(const const_iterator& rhs) const { return p == rhs.p && next == rhs.next; }
+		bool operator!=(const const_iterator& rhs) const { return !(*this == rhs); }
+	};
+	typedef const_iterator iterator;
+
+	IncidenceList() : count(0) {}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	const_iterator begin() const {
+		if (chunks.empty()) return { flat.data(), flat.data() + flat.size(), nullptr, nullptr };
+		const std::vector<Edge>& c = chunks.front();
+		return { c.data(), c.data() + c.size(), chunks.data() + 1, chunks.data() + chunks.size() };
+	}
+	const_iterator end() const {
+		if (chunks.empty()) return { flat.data() + flat.size(), flat.data() + flat.size(), nullptr, nullptr };
+		const std::vector<Edge>& c = chunks.back();
+		const std::vector<Edge>* e = chunks.data() + chunks.size();
+		return { c.data() + c.size(), c.data() + c.size(), e, e };
+	}
+
+	const Edge& front() const { return chunks.empty() ? flat.front() : chunks.front().front(); }
+	// O(d / CHUNK) on hubs
+	const Edge& operator[](size_t i) const {
+		if (chunks.empty()) return flat[i];
+		size_t c = 0;
+		while (i >= chunks[c].size()) i -= chunks[c++].size();
+		return chunks[c][i];
+	}
+
+	// the edge to t, or nullptr
+	const Edge* find(Vertex t) const {
+		const std::vector<Edge>& l = chunks.empty() ? flat : chunks[_chunk_of(t)];
+		auto it = std::lower_bound(l.begin(), l.end(), t, _target_less);
+		return it != l.end() && it->target() == t ? &*it : nullptr;
+	}
+
+	// number of edges with target below t
+	size_t rank(Vertex t) const {
+		size_t c = chunks.empty() ? 0 : _chunk_of(t);
+		const std::vector<Edge>& l = chunks.empty() ? flat : chunks[c];
+		size_t r = std::lower_bound(l.begin(), l.end(), t, _target_less) - l.begin();
+		for (size_t i = 0; i < c; i++) r += chunks[i].size();
+		return r;
+	}
+
+	void reserve(size_t n) {
+		if (n <= CONST_HUB_DEGREE) flat.reserve(n);
+	}
+
+	// e must not go before the last edge
+	void push_back(Edge e) {
+		count++;
+		if (chunks.empty()) {
+			flat.push_back(e);
+			if (count > CONST_HUB_DEGREE) _split();
+			return;
+		}
+		if (chunks.back().size() >= CHUNK) chunks.emplace_back();
+		chunks.back().push_back(e);
+	}
+
+	void insert(Edge e) {
+		size_t c = chunks.empty() ? 0 : _chunk_of(e.target());
+		std::vector<Edge>& l = chunks.empty() ? flat : chunks[c];
+		l.insert(std::upper_bound(l.begin(), l.end(), e.target(), _less_target), e);
+		count++;
+
+		if (chunks.empty()) {
+			if (count > CONST_HUB_DEGREE) _split();
+		} else if (l.size() > 2 * CHUNK) {
+			std::vector<Edge> upper(l.begin() + CHUNK, l.end());
+			l.resize(CHUNK);
+			chunks.insert(chunks.begin() + c + 1, std::move(upper));
+		}
+	}
+
+	// removes the edge to t, if there is one
+	bool erase(Vertex t) {
+		size_t c = chunks.empty() ? 0 : _chunk_of(t);
+		std::vector<Edge>& l = chunks.empty() ? flat : chunks[c];
+		auto it = std::lower_bound(l.begin(), l.end(), t, _target_less);
+		if (it == l.end() || it->target() != t) return false;
+		l.erase(it);
+		count--;
+
+		if (chunks.empty()) return true;
+		// lists switch back at half the threshold, so that a hub that
+		// loses and regains an edge isn't split every time
+		if (count < CONST_HUB_DEGREE / 2) {
+			_flatten();
+		} else if (l.empty()) {
+			chunks.erase(chunks.begin() + c);
+		} else if (c + 1 < chunks.size() && l.size() + chunks[c + 1].size() <= CHUNK) {
+			_merge_with_next(c);
+		} else if (c > 0 && chunks[c - 1].size() + l.size() <= CHUNK) {
+			_merge_with_next(c - 1);
+		}
+		return true;
+	}
+
+	void clear() {
+		flat.clear();
+		chunks.clear();
+		count = 0;
+	}
+
+private:
+	// the first chunk whose last target is at least t, or the last chunk
+	size_t _chunk_of(Vertex t) const {
+		size_t lo = 0, hi = chunks.size() - 1;
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (chunks[mid].back().target() < t) lo = mid + 1;
+			else hi = mid;
+		}
+		return lo;
+	}
+
+	void _split() {
+		for (size_t i = 0; i < flat.size(); i += CHUNK)
+			chunks.emplace_back(flat.begin() + i, flat.begin() + std::min(i + CHUNK, flat.size()));
+		std::vector<Edge>().swap(flat);
+	}
+
+	void _flatten() {
+		flat.reserve(count);
+		for (auto& c : chunks) flat.insert(flat.end(), c.begin(), c.end());
+		std::vector< std::vector<Edge> >().swap(chunks);
+	}
+
+	void _merge_with_next(size_t c) {
+		chunks[c].insert(chunks[c].end(), chunks[c + 1].begin(), chunks[c + 1].end());
+		chunks.erase(chunks.begin() + c + 1);
+	}
+};
+typedef IncidenceList::const_iterator incidence_iterator;
+
 struct Graph {
 	int vertex_count;
 	int edge_count;
 	int terminal_count;
+	// upper bound on edge weights, for choosing Dijkstra's queue
+	Weight max_weight;
 
 	std::shared_ptr<const Graph> orig_graph;
 
@@ -132,7 +357,50 @@ struct Graph {
 
 	std::vector<Edge> partial_solution;
 
-	std::deque<EdgeData> all_edge_data;
+	EdgeStore all_edge_data;
+	std::vector<EdgeInfo> edge_info;
+
+	// Vertices whose neighbourhood or terminal status changed, for the
+	// worklist driven reductions. There is one queue per class of rules:
+	// Steiner vertices go to DIRTY_STEINER, terminals to both terminal
+	// queues, and a vertex is in each queue at most once (bit q of
+	// dirty_mask). A queue left alone keeps its vertices for later.
+	enum DirtyQueue {
+		DIRTY_STEINER, DIRTY_TERMINAL_DEGREE, DIRTY_TERMINAL_EDGE, DIRTY_QUEUES
+	};
+	std::array<std::vector<Vertex>, DIRTY_QUEUES> dirty;
+	std::vector<char> dirty_mask;
+	// weight of the cheapest edge of a terminal when DIRTY_TERMINAL_EDGE last
+	// looked at it; it is correct while the terminal isn't queued there
+	// again, as any change of its edges queues it
+	std::vector<Weight> cheapest_weight;
+
+	void queue_dirty(Vertex v, int q) {
+		if (dirty_mask[v] & (1 << q)) return;
+		dirty_mask[v] |= 1 << q;
+		dirty[q].push_back(v);
+	}
+	void mark_dirty(Vertex v) {
+		if (is_terminal(v)) {
+			queue_dirty(v, DIRTY_TERMINAL_DEGREE);
+			queue_dirty(v, DIRTY_TERMINAL_EDGE);
+		} else {
+			queue_dirty(v, DIRTY_STEINER);
+		}
+	}
+	// returns -1 if queue q is empty
+	Vertex pop_dirty(int q) {
+		if (dirty[q].empty()) return -1;
+		Vertex v = dirty[q].back();
+		dirty[q].pop_back();
+		dirty_mask[v] &= ~(1 << q);
+		return v;
+	}
+	void clear_dirty() {
+		for (auto& d : dirty) d.clear();
+		dirty_mask.assign(vertex_count, 0);
+		cheapest_weight.assign(vertex_count, std::numeric_limits<Weight>::max());
+	}
 
 	Weight partial_solution_weight() const {
 		Weight weight = 0;
@@ -147,6 +415,7 @@ struct Graph {
 	void unmark_terminal(Vertex v);
 
 	Edge add_edge(Vertex s, Vertex t, int weight, int orig_s, int orig_t);
+	void add_edges(std::vector<OriginalEdge>& edges);
 
 	bool remove_edge(Edge e);
 	Vertex contract_edge(Edge e);
@@ -155,6 +424,22 @@ struct Graph {
 
 	Edge find_edge(Vertex s, Vertex t) const;
 
+	Vertex orig_source(Edge e) const {
+		assert(edge_info[e.index()].orig_edge_1 >= 0);
+		return edge_info[e.index()].orig_edge_1;
+	}
+	Vertex orig_target(Edge e) const {
+		const EdgeInfo& i = edge_info[e.index()];
+		Assert(i.orig_edge_2 >= 0 && i.orig_edge_1 >= 0, "%d %d (%d, %d, %d)",
+			e.source(), e.target(), e.weight(), i.orig_edge_1, i.orig_edge_2);
+		return i.orig_edge_2;
+	}
+	int orig_edge(Edge e) const {
+		const EdgeInfo& i = edge_info[e.index()];
+		Assert(i.orig_edge_1 == EDGE_EXT_REF, "%d %d\n", i.orig_edge_1, i.orig_edge_2);
+		return i.orig_edge_2;
+	}
+
 	void suppress_vertex(Vertex v);
 
 	void compress_graph();
@@ -162,9 +447,9 @@ struct Graph {
 	CompressedEdge compress_edge(Edge e) const {
 		return { (unsigned)e.edge_data()->edge_index * 2 + e.reverse() };
 	}
-	Edge decompress_edge(CompressedEdge ce) {
+	Edge decompress_edge(CompressedEdge ce) const {
 		assert(!ce.is_null());
-		return Edge(&all_edge_data[ce.x / 2], ce.x & 1);
+		return Edge(const_cast<EdgeData*>(&all_edge_data[ce.x / 2]), ce.x & 1);
 	}
 
 	template < typename Vector, typename Lambda >
@@ -172,7 +457,7 @@ struct Graph {
 		std::vector<int> stack;
 
 		for (auto e : edges) {
-			EdgeData *d = e.edge_data();
+			const EdgeInfo *d = &edge_info[e.index()];
 			if (d->orig_edge_1 <= -EDGE_REF_OFFSET) {
 				assert(d->orig_edge_2 <= -EDGE_REF_OFFSET);
 				stack.push_back(-(d->orig_edge_1 + EDGE_REF_OFFSET));
@@ -185,7 +470,7 @@ struct Graph {
 		}
 
 		while (!stack.empty()) {
-			const EdgeData *ed = &all_edge_data[stack.back()];
+			const EdgeInfo *ed = &edge_info[stack.back()];
 			stack.pop_back();
 
 			if (ed->orig_edge_1 <= -EDGE_REF_OFFSET) {
@@ -252,6 +537,7 @@ Graph::Graph(int vertex_count) {
 	this->vertex_count = vertex_count;
 	edge_count = 0;
 	terminal_count = 0;
+	max_weight = 0;
 
 	degrees.resize(vertex_count);
 	std::fill(degrees.begin(), degrees.end(), 0);
@@ -259,28 +545,29 @@ Graph::Graph(int vertex_count) {
 	terminal_mask.resize(vertex_count);
 	std::fill(terminal_mask.begin(), terminal_mask.end(), false);
 
+	clear_dirty();
+
 	inc_edges.resize(vertex_count);
 }
 
-void _ins_sorted(Edge e, incidence_list_t* l);
-
 Graph::Graph(const Graph &g, Graph::copy_tag) : vertex_count(g.vertex_count),
 	edge_count(g.edge_count), terminal_count(g.terminal_count),
-	orig_graph(g.orig_graph), degrees(g.degrees),
+	max_weight(g.max_weight), orig_graph(g.orig_graph), degrees(g.degrees),
 	terminals(g.terminals), terminal_mask(g.terminal_mask),
-	all_edge_data(g.all_edge_data) {
+	all_edge_data(g.all_edge_data), edge_info(g.edge_info),
+	dirty(g.dirty), dirty_mask(g.dirty_mask), cheapest_weight(g.cheapest_weight) {
+
+	// point inc_edges, edge_list, and partial_solution to our copy of the
+	// edge store; the order of all lists is kept
+	const auto rebase = [&](const auto& from, auto& to) {
+		to.reserve(from.size());
+		for (auto e : from) to.push_back(Edge(&all_edge_data[e.index()], e.reverse()));
+	};
 
-	// fix inc_edges, edge_list, and partial_solution
 	inc_edges.resize(vertex_count);
-
-	for (auto e : g.partial_solution)
-		partial_solution.push_back(Edge(&all_edge_data[e.edge_data()->edge_index]));
-
-	for (auto& ed : all_edge_data) if (!ed.removed) {
-		edge_list.push_back(Edge(&ed));
-		_ins_sorted(Edge(&ed), &inc_edges[ed.s]);
-		_ins_sorted(Edge(&ed, true), &inc_edges[ed.t]);
-	}
+	for (Vertex v = 0; v < vertex_count; v++) rebase(g.inc_edges[v], inc_edges[v]);
+	rebase(g.edge_list, edge_list);
+	rebase(g.partial_solution, partial_solution);
 }
 
 Graph::~Graph() {}
@@ -290,9 +577,9 @@ void Graph::save_orig_graph() {
 
 	orig_graph = std::shared_ptr<const Graph>(new Graph(*this, copy_tag()));
 
-	for (auto& ed : all_edge_data) {
-		ed.orig_edge_1 = EDGE_EXT_REF;
-		ed.orig_edge_2 = ed.edge_index;
+	for (size_t i = 0; i < edge_info.size(); i++) {
+		edge_info[i].orig_edge_1 = EDGE_EXT_REF;
+		edge_info[i].orig_edge_2 = i;
 	}
 }
 
@@ -322,6 +609,9 @@ void Graph::mark_terminal(Vertex v) {
 	terminals.push_back(v);
 	terminal_mask[v] = true;
 	terminal_count++;
+
+	// reduce_dirty_vertices looks at the terminal neighbours from here
+	mark_dirty(v);
 }
 
 void Graph::unmark_terminal(Vertex v) {
@@ -334,16 +624,13 @@ void Graph::unmark_terminal(Vertex v) {
 
 	terminal_mask[v] = false;
 	terminal_count--;
+	mark_dirty(v);
 }
 
 
 Edge Graph::find_edge(Vertex s, Vertex t) const {
-	for (auto e : inc_edges[s]) {
-		if (e.target() == t) {
-			return e;
-		}
-	}
-	return null_edge;
+	const Edge* e = inc_edges[s].find(t);
+	return e ? *e : null_edge;
 }
 
 bool _is_inc_list_sorted(incidence_list_t* l) {
@@ -359,18 +646,9 @@ bool _is_inc_list_sorted(incidence_list_t* l) {
 }
 
 void _ins_sorted(Edge e, incidence_list_t* l) {
-	auto it = l->begin();
-
-	Vertex t = e.target();
-
-	for( ; it != l->end(); ++it ) {
-		if( it->target() > t) {
-			break;
-		}
-	}
-	l->insert(it, e);
+	l->insert(e);
 
-	assert(_is_inc_list_sorted);
+	assert(_is_inc_list_sorted(l));
 }
 
 
@@ -395,14 +673,18 @@ Edge Graph::add_edge(Vertex s, Vertex t, int weight, Vertex orig_s, Vertex orig_
 	all_edge_data.push_back(EdgeData());
 	EdgeData* d = &all_edge_data.back();
 	d->edge_index = all_edge_data.size() - 1;
+	d->removed = false;
 	Edge e_fw(d), e_rw(d, true);
 
 	d->s = s;
 	d->t = t;
 	d->weight = weight;
+	max_weight = std::max(max_weight, weight);
 
-	d->edge_list_pos = edge_list.size();
-	d->successor_index = -1;
+	edge_info.push_back(EdgeInfo());
+	EdgeInfo* i = &edge_info.back();
+	i->edge_list_pos = edge_list.size();
+	i->successor_index = -1;
 
 	edge_list.push_back(e_fw);
 	edge_count++;
@@ -412,21 +694,83 @@ Edge Graph::add_edge(Vertex s, Vertex t, int weight, Vertex orig_s, Vertex orig_
 
 	degrees[s]++;
 	degrees[t]++;
+	mark_dirty(s);
+	mark_dirty(t);
 
-	d->orig_edge_1 = orig_s;
-	d->orig_edge_2 = orig_t;
+	i->orig_edge_1 = orig_s;
+	i->orig_edge_2 = orig_t;
 
 	return e_fw;
 }
 
-void _find_and_remove(Graph& g, Vertex s, Vertex t) {
-	incidence_list_t* l = &g.inc_edges[s];
-	for(auto it = l->begin(); it != l->end(); ++it) {
-		if( it->target() == t ) {
-			l->erase(it);
-			break;
-		}
+// Bulk version of add_edge for an empty graph. Parallel edges are merged
+// keeping the lighter one and loops are dropped; the edges are sorted once
+// so that every incidence list is built by appending. Each edge remembers
+// its endpoints as the original edge. Note: reorders the given vector.
+void Graph::add_edges(std::vector<OriginalEdge>& edges) {
+	assert(edge_count == 0 && all_edge_data.size() == 0);
+
+	for (auto& e : edges)
+		if (std::get<0>(e) > std::get<1>(e)) std::swap(std::get<0>(e), std::get<1>(e));
+	std::sort(edges.begin(), edges.end());
+
+	// count degrees first so that every list is allocated only once
+	Vertex prev_s = -1, prev_t = -1;
+	for (auto& e : edges) {
+		Vertex s = std::get<0>(e), t = std::get<1>(e);
+		if (s == t || (s == prev_s && t == prev_t)) continue;
+		degrees[s]++;
+		degrees[t]++;
+		edge_count++;
+		prev_s = s;
+		prev_t = t;
+	}
+
+	edge_list.reserve(edge_count);
+	edge_info.reserve(edge_count);
+	for (Vertex v = 0; v < vertex_count; v++) inc_edges[v].reserve(degrees[v]);
+
+	prev_s = prev_t = -1;
+	for (auto& e : edges) {
+		Vertex s = std::get<0>(e), t = std::get<1>(e);
+		// the lightest of parallel edges comes first
+		if (s == t || (s == prev_s && t == prev_t)) continue;
+		prev_s = s;
+		prev_t = t;
+
+		EdgeData d;
+		d.s = s;
+		d.t = t;
+		d.weight = std::get<2>(e);
+		max_weight = std::max(max_weight, d.weight);
+		d.edge_index = all_edge_data.size();
+		d.removed = false;
+		all_edge_data.push_back(d);
+
+		EdgeInfo i;
+		i.edge_list_pos = edge_list.size();
+		i.orig_edge_1 = s;
+		i.orig_edge_2 = t;
+		i.successor_index = -1;
+		edge_info.push_back(i);
+
+		EdgeData* ed = &all_edge_data.back();
+		edge_list.push_back(Edge(ed));
+		// edges come sorted by (s, t) and s < t, so all edges ending in
+		// a vertex are appended before all edges starting in it
+		inc_edges[s].push_back(Edge(ed));
+		inc_edges[t].push_back(Edge(ed, true));
 	}
+
+	assert(std::all_of(inc_edges.begin(), inc_edges.end(),
+		[](incidence_list_t& l) { return _is_inc_list_sorted(&l); }));
+
+	for (Vertex v = 0; v < vertex_count; v++)
+		if (degrees[v] > 0) mark_dirty(v);
+}
+
+void _find_and_remove(Graph& g, Vertex s, Vertex t) {
+	g.inc_edges[s].erase(t);
 }
 
 
@@ -442,9 +786,10 @@ bool Graph::remove_edge(Edge e) {
 	_find_and_remove(*this,s,t);
 	_find_and_remove(*this,t,s);
 
-	if (ed->edge_list_pos + 1 != edge_list.size()) {
-		std::swap(edge_list[ed->edge_list_pos], edge_list[edge_list.size() - 1]);
-		edge_list[ed->edge_list_pos].edge_data()->edge_list_pos = ed->edge_list_pos;
+	unsigned pos = edge_info[ed->edge_index].edge_list_pos;
+	if (pos + 1 != edge_list.size()) {
+		std::swap(edge_list[pos], edge_list[edge_list.size() - 1]);
+		edge_info[edge_list[pos].index()].edge_list_pos = pos;
 	}
 	edge_list.pop_back();
 
@@ -453,21 +798,54 @@ bool Graph::remove_edge(Edge e) {
 	degrees[s]--;
 	degrees[t]--;
 	edge_count--;
+	mark_dirty(s);
+	mark_dirty(t);
 
 	return true;
 }
 
 
 
-incidence_list_t _merge_inc_list(incidence_list_t* a, incidence_list_t* b, std::vector<Edge>& to_remove) {
-	auto it_a = a->begin();
-	auto it_b = b->begin();
-
+// Of two edges to the same target the lighter one is kept (the one of b on
+// ties) and the other goes to to_remove. A short list is inserted into a
+// much longer one, which is moved into the result, so that contracting a
+// leaf into a hub doesn't walk the hub's list.
+incidence_list_t _merge_inc_list(incidence_list_t* a, incidence_list_t* b,
+		std::vector<Edge>& to_remove, std::vector<EdgeInfo>& edge_info) {
 	assert(_is_inc_list_sorted(a));
 	assert(_is_inc_list_sorted(b));
 
 	incidence_list_t result;
 
+	const bool a_long = a->size() >= b->size();
+	incidence_list_t* longer = a_long ? a : b;
+	incidence_list_t* shorter = a_long ? b : a;
+	if (shorter->size() * IncidenceList::CHUNK < longer->size()) {
+		std::swap(result, *longer);
+		for (auto f : *shorter) {
+			const Edge* old = result.find(f.target());
+			if (!old) {
+				result.insert(f);
+				continue;
+			}
+			Edge e = a_long ? *old : f;
+			Edge g = a_long ? f : *old;
+			const bool keep_e = e.weight() < g.weight();
+			to_remove.push_back(keep_e ? g : e);
+			edge_info[(keep_e ? g : e).index()].successor_index = (keep_e ? e : g).index();
+			// f replaces the edge in the list if it is the one kept
+			if (keep_e != a_long) {
+				result.erase(f.target());
+				result.insert(f);
+			}
+		}
+		assert(_is_inc_list_sorted(&result));
+		return result;
+	}
+
+	auto it_a = a->begin();
+	auto it_b = b->begin();
+
 	while(it_a != a->end() && it_b != b->end()) {
 		Edge e = *it_a;
 		Edge f = *it_b;
@@ -476,12 +854,12 @@ incidence_list_t _merge_inc_list(incidence_list_t* a, incidence_list_t* b, std::
 			if(e.weight() < f.weight()) {
 				result.push_back(e);
 				to_remove.push_back(f);
-				f.edge_data()->successor_index = e.edge_data()->edge_index;
+				edge_info[f.index()].successor_index = e.index();
 			}
 			else {
 				result.push_back(f);
 				to_remove.push_back(e);
-				e.edge_data()->successor_index = f.edge_data()->edge_index;
+				edge_info[e.index()].successor_index = f.index();
 			}
 			++it_a;
 			++it_b;
@@ -515,54 +893,20 @@ void Graph::_change_edge_target(Edge e, Vertex new_target) {
 
 	assert( _is_inc_list_sorted(&inc_edges[s]) );
 
-	incidence_list_t* l = &inc_edges[s];
-
-	// debug_printf("Edge (%d,%d), new target = %d\n", s,t,new_target);
-	// print_targets(l);
-
-	if( t < new_target ) { // rotate left
-		auto rot_start = l->begin();
-		auto rot_end = l->end();
+	// the list is ordered by the targets in the edge data, so take the
+	// edge out before changing it
+	bool found = inc_edges[s].erase(t);
+	assert(found);
+	(void)found;
 
-		for(auto it = l->begin(); it != l->end(); ++it) {
-			if(it->target() == t) { // found e's position
-				rot_start = it;
-			}
-			if(it->target() > new_target) {
-				rot_end = it;
-				break;
-			}
-		}
-		if(rot_start + 1 < rot_end) { // rotation is non-trivial
-			std::rotate(rot_start, rot_start+1, rot_end);
-		}
-
-	} else { //rotate right
-		auto rot_start = l->rbegin();
-		auto rot_end = l->rend();
-		for(auto it = l->rbegin(); it != l->rend(); ++it) {
-			if(it->target() == t) { // found e's position
-				rot_start = it;
-			}
-			if(it->target() < new_target) {
-				rot_end = it;
-				break;
-			}
-		}
-		if(rot_start + 1 < rot_end) { // rotation is non-trivial
-			std::rotate(rot_start, rot_start+1, rot_end);
-		}
-	}
-
-
-	// print_targets(l);
 	if (e.reverse()) {
 		e.edge_data()->s = new_target;
 	}
 	else {
 		e.edge_data()->t = new_target;
 	}
-	// print_targets(l);
+	inc_edges[s].insert(e);
+
 	assert( _is_inc_list_sorted(&inc_edges[s]) );
 }
 
@@ -583,9 +927,12 @@ Vertex Graph::contract_edge(Edge e) {
 
 	remove_edge(e);
 
-	// merge s and t
+	// merge s and t; the merge may take over the list of t, then the
+	// edges of t are only found in the merged list
 	std::vector<Edge> to_delete;
-	incidence_list_t merged_st = _merge_inc_list(&inc_edges[s], &inc_edges[t], to_delete);
+	const bool t_isolated = inc_edges[t].empty();
+	incidence_list_t merged_st = _merge_inc_list(&inc_edges[s], &inc_edges[t], to_delete, edge_info);
+	const bool t_taken = !t_isolated && inc_edges[t].empty();
 
 	// remove arising parallel edges
 	for(auto f : to_delete) {
@@ -593,9 +940,12 @@ Vertex Graph::contract_edge(Edge e) {
 	}
 
 	// renumber edges from t
-	for(auto f : inc_edges[t]) {
+	for(auto f : t_taken ? merged_st : inc_edges[t]) {
+		if (f.source() != t) continue;
 		_change_edge_target(f.opposite_dir(),s);
+		mark_dirty(f.target());
 	}
+	mark_dirty(s);
 
 	std::swap(inc_edges[s], merged_st);
 	inc_edges[t].clear();
@@ -615,8 +965,8 @@ Vertex Graph::contract_edge(Edge e) {
 
 Vertex Graph::buy_edge(Edge e) {
 	EdgeData* ed = e.edge_data();
-	while( ed->successor_index != -1 ) {
-		ed = &all_edge_data[ed->successor_index];
+	while( edge_info[ed->edge_index].successor_index != -1 ) {
+		ed = &all_edge_data[edge_info[ed->edge_index].successor_index];
 	}
 
 	if(ed->removed) {
@@ -639,8 +989,8 @@ void Graph::suppress_vertex(Vertex v) {
 	Vertex s = e.target();
 	Vertex t = f.target();
 
-	add_edge(s,t,e.weight() + f.weight(), -(e.edge_data()->edge_index + EDGE_REF_OFFSET),
-		-(f.edge_data()->edge_index + EDGE_REF_OFFSET));
+	add_edge(s,t,e.weight() + f.weight(), -(e.index() + EDGE_REF_OFFSET),
+		-(f.index() + EDGE_REF_OFFSET));
 
 	remove_edge(e);
 	remove_edge(f);
@@ -656,6 +1006,7 @@ void Graph::compress_graph() {
 			degrees[j] = degrees[i];
 			std::swap(inc_edges[j], inc_edges[i]);
 			terminal_mask[j] = terminal_mask[i];
+			cheapest_weight[j] = cheapest_weight[i];
 			j++;
 		}
 	}
@@ -665,11 +1016,20 @@ void Graph::compress_graph() {
 	degrees.resize(compressed_size);
 	inc_edges.resize(compressed_size);
 	terminal_mask.resize(compressed_size);
+	cheapest_weight.resize(compressed_size);
 
 	for(auto& t : terminals) {
 		t = forward_map[t];
 	}
 
+	dirty_mask.assign(compressed_size, 0);
+	for (int q = 0; q < DIRTY_QUEUES; q++) {
+		std::vector<Vertex> old_dirty;
+		std::swap(dirty[q], old_dirty);
+		for (auto v : old_dirty)
+			if (forward_map[v] >= 0) queue_dirty(forward_map[v], q);
+	}
+
 	for(auto e : edge_list) {
 		e.edge_data()->s = forward_map[e.edge_data()->s];
 		e.edge_data()->t = forward_map[e.edge_data()->t];
@@ -854,6 +1214,7 @@ namespace boost {
 
 } // namespace boost
 
+#include "csr.hpp"
 #include "dfs.hpp"
 #include "heuristics.hpp"
 
@@ -875,7 +1236,7 @@ void print_solution(FILE* out, Graph &g) {
 
 		fprintf(out, "VALUE %d\n", weight);
 		for (auto e : sol) {
-			fprintf(out, "%d %d\n", e.orig_source(), e.orig_target());
+			fprintf(out, "%d %d\n", tmp.orig_source(e), tmp.orig_target(e));
 		}
 	} TIMER_END("%s: %lg s\n", __func__, timer);
 }
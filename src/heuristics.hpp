@@ -3,10 +3,14 @@
 
 #include <cassert>
 #include <vector>
+#include <deque>
 #include <unordered_set>
-#include "boost/graph/dijkstra_shortest_paths_no_color_map.hpp"
+#include <atomic>
+#include <mutex>
 #include "boost/functional/hash.hpp"
 #include "tdist.hpp"
+#include "sdist.hpp"
+#include "parallel.hpp"
 
 #include "graph.hpp"
 #include "debug.hpp"
@@ -15,72 +19,98 @@ extern volatile sig_atomic_t g_stop_signal;
 
 using namespace boost;
 
-void handle_small_Steiner_degrees(Graph& g) {
-	int deg1_steiner = 0, suppress = 0;
+Edge cheapest_edge_from(Graph& g, Vertex v) {
+	Edge min_edge = null_edge;
+	for(auto e : g.inc_edges[v]) {
+		if( e.weight() < min_edge.weight() ) {
+			min_edge = e;
+		}
+	}
+	return min_edge;
+}
+
+// each class of rules has its own queue of dirty vertices, rule 1 << q
+// takes its vertices from Graph::dirty[q]
+enum CheapRules {
+	// remove Steiner leaves, suppress Steiner vertices of degree 2
+	STEINER_DEGREE_RULES = 1 << Graph::DIRTY_STEINER,
+	// buy the edge of terminal leaves
+	TERMINAL_DEGREE_RULES = 1 << Graph::DIRTY_TERMINAL_DEGREE,
+	// buy the cheapest edge of a terminal if it leads to another terminal
+	TERMINAL_EDGE_RULES = 1 << Graph::DIRTY_TERMINAL_EDGE,
+	ALL_CHEAP_RULES = 7
+};
+
+// Applies the given rules to the dirty vertices of g, and to those they make
+// dirty, until their queues are empty; the work is proportional to the
+// changes since the last call. The queues of the other rules are left as
+// they are. Terminals whose edge got bought are flagged in invalid_map.
+void reduce_dirty_vertices(Graph& g, int rules, std::vector<bool>* invalid_map = nullptr) {
+	int deg1_steiner = 0, suppress = 0, deg1_terms = 0, term_edges = 0;
 
 	TIMER_BEGIN {
 
-	for(Vertex v = 0; v < g.vertex_count; v++) {
-		if (!g.is_terminal(v)) {
-			if( g.degrees[v] == 1) {
+	int q = 0;
+	while (true) {
+		// the first queue with work
+		for (q = 0; q < Graph::DIRTY_QUEUES; q++)
+			if ((rules & (1 << q)) && !g.dirty[q].empty()) break;
+		if (q == Graph::DIRTY_QUEUES) break;
+
+		Vertex v = g.pop_dirty(q);
+		// a vertex that changed sides since is in the right queues as well
+		if (g.degrees[v] == 0 || g.is_terminal(v) != (q != Graph::DIRTY_STEINER)) continue;
+
+		if (q == Graph::DIRTY_STEINER) {
+			if (g.degrees[v] == 1) {
 				g.remove_edge(g.inc_edges[v].front());
 				deg1_steiner++;
-			} else if(g.degrees[v] == 2) {
+			} else if (g.degrees[v] == 2) {
 				g.suppress_vertex(v);
 				suppress++;
 			}
-		}
-	}
-
-	} TIMER_END("  %s: steiner %d, suppress %d in %lg s\n",
-		__func__, deg1_steiner, suppress, timer);
-}
-
-void handle_small_terminal_degrees(Graph& g, std::vector<bool>& invalid_map) {
-	int deg1_terms = 0;
-
-	TIMER_BEGIN {
-
-	for(Vertex v = 0; v < g.vertex_count; v++) {
-		if(( g.degrees[v] == 1) && (g.is_terminal(v))) {
+		} else if (q == Graph::DIRTY_TERMINAL_DEGREE) {
+			if (g.degrees[v] == 1) {
 				g.buy_edge(g.inc_edges[v].front());
-				invalid_map[v] = true;
+				if (invalid_map) (*invalid_map)[v] = true;
 				deg1_terms++;
+			}
+		} else {
+			// among the cheapest edges prefer one to a terminal
+			Edge e = null_edge;
+			for (auto f : g.inc_edges[v]) {
+				if (f.weight() < e.weight() || (f.weight() == e.weight() &&
+						g.is_terminal(f.target()) && !g.is_terminal(e.target())))
+					e = f;
+			}
+			g.cheapest_weight[v] = e.weight();
+			if (g.terminal_count < 2) continue;
+
+			// v may have just become a terminal, so a terminal neighbour u
+			// may now have a cheapest edge to it; u would buy that edge
+			for (auto f : g.inc_edges[v]) {
+				Vertex u = f.target();
+				if (g.is_terminal(u) && f.weight() <= g.cheapest_weight[u])
+					g.queue_dirty(u, Graph::DIRTY_TERMINAL_EDGE);
+			}
+			if (g.is_terminal(e.target())) term_edges += (g.buy_edge(e) != -1);
 		}
 	}
 
-	} TIMER_END("  %s: terms %d in %lg s\n",
-		__func__, deg1_terms, timer);
+	} TIMER_END("  %s: steiner %d, suppress %d, terms %d, terminal edges %d in %lg s\n",
+		__func__, deg1_steiner, suppress, deg1_terms, term_edges, timer);
 }
 
-Edge cheapest_edge_from(Graph& g, Vertex v) {
-	Edge min_edge = null_edge;
-	for(auto e : g.inc_edges[v]) {
-		if( e.weight() < min_edge.weight() ) {
-			min_edge = e;
-		}
-	}
-	return min_edge;
+void handle_small_Steiner_degrees(Graph& g) {
+	reduce_dirty_vertices(g, STEINER_DEGREE_RULES);
 }
 
-void shortest_edge_between_terminals(Graph& g) {
-	int count = 0;
-	TIMER_BEGIN {
-	std::vector<Edge> possible_contractions;
-
-	if (g.terminal_count == 1) return;
-
-	for (auto t : g.terminals) {
-		Edge e = cheapest_edge_from(g,t);
-		assert(e != null_edge);
-
-		if (g.is_terminal(e.target()))
-			possible_contractions.push_back(e);
-	}
-
-	for (auto e : possible_contractions) count += (g.buy_edge(e) != -1);
+void handle_small_terminal_degrees(Graph& g, std::vector<bool>& invalid_map) {
+	reduce_dirty_vertices(g, TERMINAL_DEGREE_RULES, &invalid_map);
+}
 
-	} TIMER_END("  %s: %d edges in %lg s\n", __func__, count, timer);
+void shortest_edge_between_terminals(Graph& g) {
+	reduce_dirty_vertices(g, TERMINAL_EDGE_RULES);
 }
 
 
@@ -100,111 +130,124 @@ void buy_zero(Graph& g) {
 }
 
 //Easy deletions without dijkstra, only cheries.
+//
+// An edge (u, v) is deleted if some w has w(u, w) + w(w, v) <= w(u, v). The
+// cherries are found in parallel on a snapshot and deleted in order of
+// weight in one pass: a cherry of two lighter edges stays a valid detour even
+// if those get deleted too, since their own detours are lighter still. A
+// cherry using an edge as heavy as (u, v) (next to a 0-edge) is only used if
+// both its edges are still there.
 void delete_edges(Graph& g) {
-	int count = 0;
-	int rounds = 0;
-	bool rerun=false;
-
-	TIMER_BEGIN { do {
-	rerun = false;
-	rounds++;
-	std::vector<Edge> to_del;
-
-	std::vector<bool> marked(g.vertex_count,false);
-
-	for(auto e : g.edge_list){
-//    debug_printf("%d source %d target", e.source(),e.target());
-		auto i = &g.inc_edges[e.source()];
-		auto j = &g.inc_edges[e.target()];
-		auto it = i->begin();
-		auto jt = j->begin();
-
-		while (it != i->end() && jt != j->end()) {
-			if (it->target() == jt->target()) {
-				if (jt->weight() + it->weight() <= e.weight()) {
-					to_del.push_back(e);
-					break;
-				}
-				++it; ++jt;
-			} else if (it->target() < jt->target()) {
-				++it;
-			} else {
-				++jt;
-			}
-		}
-	}
-	//Rewrite to separate function perhaps.
-	for(auto e : to_del){
-		if(marked[e.source()]!=true&&marked[e.target()]!=true){
-			marked[e.source()]=true;
-			marked[e.target()]=true;
-			//debug_printf("deleted edge %d source %d target  %d e.weight \n", e.source(),e.target(), e.weight() );
-			g.remove_edge(e);
-			count++;
-		}else{
-			//debug_printf("NOT deleted edge %d source %d target  %d e.weight \n", e.source(),e.target(), e.weight() );
-			rerun=true;
+	unsigned count = 0;
+
+	TIMER_BEGIN {
+		const CSRGraph csr(g);
+
+		struct Cherry {
+			Edge e;
+			unsigned a, b; // slots of (u, w) and (v, w)
+			bool strict;
+		};
+		std::vector< std::vector<Cherry> > found(thread_count());
+
+		parallel_for(csr.edge_list.size(), [&](int i, int thread) {
+			Edge e = csr.edge_list[i];
+			Weight limit = e.weight();
+			Cherry c{e, 0, 0, false};
+			bool any = false;
+
+			for_common_targets(csr, e.source(), e.target(), [&](unsigned a, unsigned b) {
+				Weight wa = csr.weights[a], wb = csr.weights[b];
+				if (wa + wb > limit) return false;
+				if (!any || std::max(wa, wb) < limit)
+					c = Cherry{e, a, b, std::max(wa, wb) < limit};
+				any = true;
+				return c.strict;
+			});
+			if (any) found[thread].push_back(c);
+		});
+
+		std::vector<Cherry> to_del;
+		for (auto& f : found) to_del.insert(to_del.end(), f.begin(), f.end());
+		std::sort(to_del.begin(), to_del.end(), [](const Cherry& x, const Cherry& y) {
+			return x.e.weight() != y.e.weight() ? x.e.weight() < y.e.weight() : x.e < y.e;
+		});
+
+		for (auto& c : to_del) {
+			if (c.strict || (!csr.edges[c.a].is_removed() && !csr.edges[c.b].is_removed()))
+				count += g.remove_edge(c.e);
 		}
-	}
 
-	} while (rerun);
-	} TIMER_END("  %s: deleted %d edges in %lg s\n", __func__, count, timer);
+	} TIMER_END("  %s: deleted %u edges in %lg s\n", __func__, count, timer);
 }
 
 
 // WARNING: requires no 0-edges in graph
+//
+// An edge is deleted if there is another path between its endpoints that is
+// not longer. All edges of such a path are strictly lighter, so all the
+// deletions found on the unmodified graph can be done at once. The searches
+// run in parallel on a snapshot; the result does not depend on the number of
+// threads.
 void delete_edges_shortest_path(Graph &g) {
 	unsigned count = 0;
 
 	TIMER_BEGIN {
-		std::vector<Weight> dist(num_vertices(g));
-		const auto cmp = [&](Vertex a, Vertex b) { return dist[a] < dist[b]; };
-		Heap<Vertex, decltype(cmp), std::vector<unsigned>, 4> heap{cmp};
-		heap.map.assign(g.vertex_count, heap.not_in_heap);
-
-		std::vector<int> pred_count(num_vertices(g), 0);
-		std::vector<char> neighbor_mask(num_vertices(g), 0);
-
-		for (Vertex v = 0; v < num_vertices(g); ++v) {
-			dist.assign(g.vertex_count, std::numeric_limits<Weight>::max());
-			int neighbors_to_go = g.inc_edges[v].size();
-			for (auto e : g.inc_edges[v]) neighbor_mask[e.target()] = true;
-			pred_count[v] = 1;
-
-			dist[v] = 0;
-			heap.push(v);
-			try {
-				Dummy pred_map;
-				Dijkstra(g, dist, pred_map, heap,
-					[&](Vertex v) {
-						if (neighbor_mask[v]) {
-							neighbors_to_go--;
-							neighbor_mask[v] = false;
-						}
-						if (neighbors_to_go <= 0) throw EarlyTerminate();
-					},
-					[&](Edge e) { pred_count[e.target()] = 1; },
-					[&](Edge e) {
-						if (dist[e.source()] + e.weight() == dist[e.target()])
-							pred_count[e.target()]++;
-					}
-				);
-			} catch (EarlyTerminate e) {}
-
-			while (!heap.empty()) heap.pop();
+		const CSRGraph csr(g);
 
-			// edges vs. shortest path & possibly delete
+		struct Scratch {
+			DijkstraWorkspace ws;
+			std::vector<int> pred_count;
+			std::vector<char> neighbor_mask;
 			std::vector<Edge> to_remove;
-			for (auto e : g.inc_edges[v]) {
-				assert(e.source() == v);
+
+			Scratch(const CSRGraph& g) : ws(g), pred_count(g.vertex_count, 0),
+				neighbor_mask(g.vertex_count, 0) {}
+		};
+		std::vector< std::unique_ptr<Scratch> > scratch;
+		for (int i = 0; i < thread_count(); i++) scratch.emplace_back(new Scratch(csr));
+
+		parallel_for(csr.vertex_count, [&](Vertex v, int thread) {
+			Scratch& s = *scratch[thread];
+			auto& dist = s.ws.dist;
+
+			s.ws.reset();
+			int neighbors_to_go = csr.degree(v);
+			for (auto e : csr.arcs(v)) s.neighbor_mask[e.target()] = true;
+			s.pred_count[v] = 1;
+
+			s.ws.add_source(v);
+			Dummy pred_map;
+			Dijkstra(csr, dist, pred_map, s.ws,
+				[&](Vertex v) {
+					if (s.neighbor_mask[v]) {
+						neighbors_to_go--;
+						s.neighbor_mask[v] = false;
+					}
+					return neighbors_to_go <= 0 ? Visit::Stop : Visit::Continue;
+				},
+				[&](CSRGraph::Arc e) { s.pred_count[e.target()] = 1; },
+				[&](CSRGraph::Arc e) {
+					if (dist[e.source()] + e.weight() == dist[e.target()])
+						s.pred_count[e.target()]++;
+				}
+			);
+
+			// edges vs. shortest path
+			for (auto e : csr.arcs(v)) {
 				Vertex u = e.target();
-				if (e.weight() > dist[u] || (e.weight() == dist[u] && pred_count[u] > 1))
-					to_remove.push_back(e);
+				if (e.weight() > dist[u] || (e.weight() == dist[u] && s.pred_count[u] > 1))
+					s.to_remove.push_back(e);
 			}
+		});
 
-			count += to_remove.size();
-			for (auto e : to_remove) g.remove_edge(e);
-		}
+		std::vector<Edge> to_remove;
+		for (auto& s : scratch)
+			to_remove.insert(to_remove.end(), s->to_remove.begin(), s->to_remove.end());
+		std::sort(to_remove.begin(), to_remove.end());
+
+		for (auto e : to_remove)
+			if (g.remove_edge(e)) count++;
 
 	} TIMER_END("  %s: deleted %u edges in %lg s\n", __func__, count, timer);
 }
@@ -246,7 +289,7 @@ Weight clean_up_solution(const Graph &g, const std::vector<Edge>& sol, Out out)
 			}
 			if (marked[v]) {
 				marked[p] = true;
-				Edge g_edge = sol[e.orig_edge()];
+				Edge g_edge = sol[tmp.orig_edge(e)];
 				w += g_edge.weight();
 				*out++ = g_edge;
 			}
@@ -262,8 +305,11 @@ Weight clean_up_solution(const Graph &g, const std::vector<Edge>& sol, Out out)
 	return w;
 }
 
-template < typename Out >
-Weight refine_solution(Graph &g, const std::vector<Vertex>& fake_terminals, Out out) {
+// search_graph is g itself, a CSRGraph snapshot of it or an IncrementalVoronoi
+// over the snapshot
+template < typename G, typename Out >
+Weight refine_solution(Graph &g, G& search_graph,
+	const std::vector<Vertex>& fake_terminals, Out out) {
 	Weight w = 0;
 	TIMER_BEGIN {
 
@@ -273,7 +319,7 @@ Weight refine_solution(Graph &g, const std::vector<Vertex>& fake_terminals, Out
 	for (auto v : find_branching_vertices(g)) g.mark_terminal(v);
 
 	std::vector<Edge> new_sol;
-	greedy_2approx(g, std::back_inserter(new_sol));
+	greedy_2approx(search_graph, std::back_inserter(new_sol));
 
 	while (g.terminals.size() > real_terminal_count)
 		g.unmark_terminal(g.terminals[g.terminals.size() - 1]);
@@ -285,6 +331,11 @@ Weight refine_solution(Graph &g, const std::vector<Vertex>& fake_terminals, Out
 	return w;
 }
 
+template < typename Out >
+Weight refine_solution(Graph &g, const std::vector<Vertex>& fake_terminals, Out out) {
+	return refine_solution(g, g, fake_terminals, out);
+}
+
 bool structure_rotate(std::vector<std::pair<int, int>>& S, int node, bool right) {
 #define Node(x, right) (right ? S[x].second : S[x].first)
 	const auto is_term_node = [&](int n) {
@@ -357,101 +408,256 @@ auto get_solution_structure(const Graph& g) {
 	return ret;
 }
 
-template < typename Out >
-Weight dreyfus_zid(Graph& g, const std::vector<std::pair<int, int>>& structure, Out out) {
-	debug_printf("\nCalling %s\n", __func__);
-	Weight weight = 0;
-
-	if (structure.size() * g.vertex_count > 400*1000*1000) {
-		debug_printf("Graph is too large (%d vertices, %d terminals), givin up!\n",
-			g.vertex_count, (int)g.terminals.size());
-		return -1;
-	}
+// Evaluation of a dreyfus_zid structure with distances of type D, saturated
+// at cap. The child of a node that needs more live distance vectors goes
+// first (Sethi-Ullman), which keeps about log2 of the number of terminals of
+// them alive. Sibling subtrees are evaluated in parallel while there are
+// threads and memory for both; the result does not depend on that.
+template < typename D, typename G >
+struct DreyfusZid {
+	struct Key {
+		const std::vector<D>* dist;
+		Weight operator()(Vertex v) const { return (*dist)[v]; }
+	};
+	typedef MonotoneHeap<Vertex, Key, std::vector<unsigned>> Heap;
 
-	TIMER_BEGIN {
+	// what one thread of the evaluation searches with, reused for every node
+	struct Scratch {
+		Heap heap;
+		std::vector<Vertex> seeds;
+	};
 
+	// Shortest paths from the terminals of leaves are searched again when
+	// the solution is put together. Inner nodes keep the last edge of the
+	// path to every vertex as its incidence_slot, one byte each; slots too
+	// large for that go to hub_pred.
+	enum : uint8_t { NO_PRED = 255, HUB_PRED = 254 };
 	struct S {
-		std::vector<Weight> dist;
-		std::vector<CompressedEdge> pred_e;
+		std::vector<D> dist;
+		std::vector<uint8_t> pred;
+		std::vector<std::pair<Vertex, int>> hub_pred; // sorted by vertex
 	};
-	std::vector<S> stack;
 
-	Weight* dist = nullptr;
-	const auto cmp = [&](Vertex a, Vertex b) { return dist[a] < dist[b]; };
-	Heap<Vertex, decltype(cmp), std::vector<unsigned>, 4> heap{cmp};
-	heap.map.assign(g.vertex_count, heap.not_in_heap);
+	const G& g;
+	const std::vector<std::pair<int, int>>& structure;
+	const Weight cap;
+	// a Scratch for another thread costs as much as this many distance vectors
+	const int scratch_vectors;
+	std::vector<int> need; // live distance vectors needed by a subtree
+	std::vector<S> nodes;
+
+	DreyfusZid(const G& g, const std::vector<std::pair<int, int>>& structure, Weight cap,
+		int scratch_vectors) :
+		g(g), structure(structure), cap(cap), scratch_vectors(scratch_vectors),
+		need(structure.size()), nodes(structure.size()) {
+		for (int i = 0; i < (int)structure.size(); i++) {
+			if (structure[i].first == -1) {
+				need[i] = 1;
+				continue;
+			}
+			int a = need[structure[i].first], b = need[structure[i].second];
+			need[i] = a == b ? a + 1 : std::max(a, b);
+		}
+	}
+
+	Scratch make_scratch() const {
+		Scratch s{ Heap(Key{nullptr}, g.max_weight), {} };
+		s.heap.map.assign(g.vertex_count, s.heap.not_in_heap);
+		return s;
+	}
 
-	for (int i = 0; i < (int)structure.size(); i++) {
-		CHECK_SIGNALS(return -1);
+	// Computes the distances of node i holding at most memory distance vectors
+	// at once, on up to threads threads; scratch for the threads it starts
+	// comes out of memory too. Returns false if interrupted.
+	bool evaluate(int i, int memory, int threads, Scratch& scratch) {
+		Heap& heap = scratch.heap;
+		CHECK_SIGNALS(return false);
 
-		stack.push_back({});
-		auto& cur = stack.back();
+		auto& cur = nodes[i];
 
 		if (structure[i].first == -1) {
 			Vertex t = structure[i].second;
-			cur.pred_e.assign(g.vertex_count, CompressedEdge());
-			cur.dist.assign(g.vertex_count, std::numeric_limits<Weight>::max());
+			cur.dist.assign(g.vertex_count, cap);
 			cur.dist[t] = 0;
 
+			heap.key.dist = &cur.dist;
 			heap.push(t);
-			dist = &cur.dist[0];
-			Dijkstra(g, cur.dist, dummy, heap, dummy, [&](Edge e){
-				cur.pred_e[e.target()] = g.compress_edge(e);
-			});
+			Dijkstra(g, cur.dist, dummy, heap);
+			return true;
+		}
+
+		int a = structure[i].first, b = structure[i].second;
+		if (need[a] < need[b]) std::swap(a, b);
+
+		const int spare = memory - need[a] - need[b] - scratch_vectors;
+		if (threads > 1 && spare >= 0) {
+			const int memory_b = need[b] + spare / 2;
+			const int threads_b = threads / 2;
+			bool done[2];
+			parallel_for(2, [&](int k, int) {
+				if (k == 0) {
+					done[0] = evaluate(a, memory - memory_b - scratch_vectors,
+						threads - threads_b, scratch);
+				} else {
+					Scratch scratch_b = make_scratch();
+					done[1] = evaluate(b, memory_b, threads_b, scratch_b);
+				}
+			}, 1);
+			if (!done[0] || !done[1]) return false;
 		} else {
-			cur.pred_e.assign(g.vertex_count, CompressedEdge());
-			std::swap(cur.dist, stack[structure[i].first].dist);
-			auto& s_dist = stack[structure[i].second].dist;
-			for (int i = 0; i < g.vertex_count; i++)
-				cur.dist[i] += s_dist[i];
-			s_dist.clear();
-
-			for (Vertex v = 0; v < g.vertex_count; v++) heap.push(v);
-			dist = &cur.dist[0];
-			Dijkstra(g, cur.dist, dummy, heap, dummy, [&](Edge e){
-				cur.pred_e[e.target()] = g.compress_edge(e);
+			if (!evaluate(a, memory, threads, scratch)) return false;
+			if (!evaluate(b, memory - 1, threads, scratch)) return false;
+		}
+
+		cur.pred.assign(g.vertex_count, NO_PRED);
+		cur.hub_pred.clear();
+		std::swap(cur.dist, nodes[structure[i].first].dist);
+		auto& s_dist = nodes[structure[i].second].dist;
+		for (int i = 0; i < g.vertex_count; i++)
+			cur.dist[i] = std::min<Weight>(cap, cur.dist[i] + s_dist[i]);
+		std::vector<D>().swap(s_dist);
+
+		// vertices at cap cannot improve anything
+		auto& seeds = scratch.seeds;
+		seeds.clear();
+		for (Vertex v = 0; v < g.vertex_count; v++)
+			if (cur.dist[v] < cap) seeds.push_back(v);
+		heap.key.dist = &cur.dist;
+		heap.build(seeds);
+		Dijkstra(g, cur.dist, dummy, heap, dummy, [&](Edge e){
+			Vertex v = e.target();
+			int slot = incidence_slot(g, v, e.source());
+			if (slot < HUB_PRED) {
+				cur.pred[v] = slot;
+			} else {
+				cur.pred[v] = HUB_PRED;
+				cur.hub_pred.push_back({v, slot});
+			}
+		});
+
+		// keep the last entry of every vertex, sorted for the traceback
+		auto& hub = cur.hub_pred;
+		std::stable_sort(hub.begin(), hub.end(),
+			[](const std::pair<Vertex, int>& x, const std::pair<Vertex, int>& y) {
+				return x.first < y.first;
 			});
+		size_t kept = 0;
+		for (size_t j = 0; j < hub.size(); j++) {
+			if (kept > 0 && hub[kept - 1].first == hub[j].first) kept--;
+			hub[kept++] = hub[j];
 		}
+		hub.resize(kept);
+		return true;
 	}
 
-	std::vector<std::pair<int, Vertex>> ret_stack;
-	ret_stack.push_back({stack.size() - 1, g.terminals[0]});
+	template < typename Out >
+	Weight run(int memory, int threads, Out out) {
+		{
+			Scratch scratch = make_scratch();
+			if (!evaluate(structure.size() - 1, memory, threads, scratch)) return -1;
+		}
 
-	while (!ret_stack.empty()) {
-		const int i = ret_stack.back().first;
-		const auto& cur = stack[i];
-		Vertex v = ret_stack.back().second;
-		ret_stack.pop_back();
+		if (nodes.back().dist[g.terminals[0]] >= cap) return -1;
+		std::vector<D>().swap(nodes.back().dist);
+
+		Weight weight = 0;
+		DijkstraWorkspace ws(g);
+		std::vector<Edge> leaf_pred(g.vertex_count);
+
+		std::vector<std::pair<int, Vertex>> ret_stack;
+		ret_stack.push_back({structure.size() - 1, g.terminals[0]});
+
+		while (!ret_stack.empty()) {
+			const int i = ret_stack.back().first;
+			const auto& cur = nodes[i];
+			Vertex v = ret_stack.back().second;
+			ret_stack.pop_back();
+
+			if (structure[i].first == -1) {
+				Vertex t = structure[i].second;
+				ws.reset();
+				ws.add_source(t);
+				Dijkstra(g, ws.dist, dummy, ws,
+					[&](Vertex u) { return u == v ? Visit::Stop : Visit::Continue; },
+					[&](Edge e) { leaf_pred[e.target()] = e; }
+				);
+				for (; v != t; v = leaf_pred[v].source()) {
+					*out++ = leaf_pred[v];
+					weight += leaf_pred[v].weight();
+				}
+				continue;
+			}
 
-		while (!cur.pred_e[v].is_null()) {
-			Edge e = g.decompress_edge(cur.pred_e[v]);
-			*out++ = e;
-			weight += e.weight();
-			v = e.source();
-		}
+			while (cur.pred[v] != NO_PRED) {
+				int slot = cur.pred[v];
+				if (slot == HUB_PRED) {
+					slot = std::lower_bound(cur.hub_pred.begin(), cur.hub_pred.end(), v,
+						[](const std::pair<Vertex, int>& p, Vertex u) { return p.first < u; })->second;
+				}
+				Edge e = incidence_at(g, v, slot).opposite_dir();
+				*out++ = e;
+				weight += e.weight();
+				v = e.source();
+			}
 
-		if (structure[i].first != -1) {
 			ret_stack.push_back({structure[i].first, v});
 			ret_stack.push_back({structure[i].second, v});
 		}
+
+		return weight;
 	}
+};
+
+// Best tree with the given structure. bound is an upper bound on its weight
+// (e.g. that of the solution the structure comes from) or -1; when it is
+// small, distances are stored in 16 bits. Sibling subtrees are evaluated on
+// up to threads threads. Returns -1 if the search would not fit
+// CONST_DREYFUS_ZID_MEMORY or got interrupted.
+template < typename G, typename Out >
+Weight dreyfus_zid(const G& g, const std::vector<std::pair<int, int>>& structure,
+	Out out, Weight bound = -1, int threads = thread_count()) {
+	debug_printf("\nCalling %s\n", __func__);
+	Weight weight = -1;
+
+	const bool compact = bound >= 0 && bound < std::numeric_limits<uint16_t>::max();
+	const Weight cap = compact ? bound + 1 : std::numeric_limits<Weight>::max() / 2;
+	const size_t n = g.vertex_count;
+	const size_t inner = structure.size() / 2;
+	const size_t vector_size = n * (compact ? sizeof(uint16_t) : sizeof(Weight));
+	const size_t pred_memory = n * inner * sizeof(uint8_t);
+	// heap index, seeds and the heap entries of a search, at most one for
+	// every vertex and arc
+	const size_t scratch_memory = n * (sizeof(unsigned) + sizeof(Vertex)) +
+		(n + 2 * g.edge_list.size()) * 2 * sizeof(unsigned);
+	const int scratch_vectors = (scratch_memory + vector_size - 1) / vector_size;
+	// the traceback searches from leaves with a DijkstraWorkspace
+	const size_t trace_memory = n * (sizeof(Weight) + sizeof(Edge)) + scratch_memory;
 
+	TIMER_BEGIN {
+		const auto run = [&](auto&& dz) {
+			const size_t need = dz.need.back() * vector_size + scratch_memory;
+			if (pred_memory + std::max(need, trace_memory) > CONST_DREYFUS_ZID_MEMORY) {
+				debug_printf("Graph is too large (%d vertices, %d terminals, %zu MB), givin up!\n",
+					g.vertex_count, (int)g.terminals.size(),
+					(pred_memory + std::max(need, trace_memory)) >> 20);
+				return -1;
+			}
+			const size_t vectors =
+				(CONST_DREYFUS_ZID_MEMORY - pred_memory - scratch_memory) / vector_size;
+			// more than enough for all nodes and threads
+			const size_t most = structure.size() + threads * scratch_vectors;
+			return dz.run(std::min(vectors, most), threads, out);
+		};
+		weight = compact ?
+			run(DreyfusZid<uint16_t, G>(g, structure, cap, scratch_vectors)) :
+			run(DreyfusZid<Weight, G>(g, structure, cap, scratch_vectors));
 	} TIMER_END("%s: %lg s\n", __func__, timer);
 
 	return weight;
 }
 
 void run_cheap_heuristics(Graph& g) {
-	std::vector<bool> invalid_map(g.vertex_count, true);
-	int edge_count = num_edges(g);
-	int prev_count = -1;
-	while(prev_count != edge_count) {
-		handle_small_terminal_degrees(g, invalid_map);
-		handle_small_Steiner_degrees(g);
-		shortest_edge_between_terminals(g);
-		prev_count = edge_count;
-		edge_count = num_edges(g);
-	}
+	reduce_dirty_vertices(g, ALL_CHEAP_RULES);
 }
 
 void run_all_heuristics(Graph& g) {
@@ -466,6 +672,10 @@ void run_all_heuristics(Graph& g) {
 	run_cheap_heuristics(g);
 	g.compress_graph();
 
+	special_distance_test(g);
+	run_cheap_heuristics(g);
+	g.compress_graph();
+
 	terminal_distance_test(g);
 	run_cheap_heuristics(g);
 	g.compress_graph();
@@ -487,10 +697,7 @@ void run_noninvalidating_heuristics(Graph& g) {
 }
 
 void run_possibly_invalidating_heuristics(Graph& g, std::vector<bool>& invalid_map) {
-	TIMER_BEGIN {
-		handle_small_Steiner_degrees(g);
-		handle_small_terminal_degrees(g, invalid_map);
-	} TIMER_END("%s: %lg s\n", __func__, timer);
+	reduce_dirty_vertices(g, STEINER_DEGREE_RULES | TERMINAL_DEGREE_RULES, &invalid_map);
 }
 
 
@@ -503,9 +710,50 @@ size_t hash_sol(const std::vector<Edge>& sol) {
 	return ret;
 }
 
-Graph end_heu(const Graph& g, const std::vector<Vertex>& possible_vertices) {
-	debug_printf("\nCalling %s\n", __func__);
-	Graph tmp = g.get_solution();
+// Best solution found by the end_heu workers. Its weight can be read without
+// locking; the edges are kept compressed, so that they are valid in every
+// copy of the solution graph.
+struct PortfolioBest {
+	std::atomic<Weight> weight;
+	std::mutex mutex; // guards sol
+	std::vector<CompressedEdge> sol;
+	// dreyfus_zid may take a lot of memory, so only one runs at a time;
+	// the other workers skip their passes meanwhile
+	std::mutex dz_mutex;
+
+	PortfolioBest(const Graph& g, const std::vector<Edge>& s, Weight w) : weight(w) {
+		for (auto e : s) sol.push_back(g.compress_edge(e));
+	}
+
+	void offer(const Graph& g, const std::vector<Edge>& s, Weight w) {
+		if (w >= weight) return;
+		std::lock_guard<std::mutex> lock(mutex);
+		if (w >= weight) return;
+		sol.clear();
+		for (auto e : s) sol.push_back(g.compress_edge(e));
+		weight = w;
+	}
+
+	// replaces s by the best solution if that is lighter than w
+	bool fetch(const Graph& g, std::vector<Edge>& s, Weight& w) {
+		if (weight >= w) return false;
+		std::lock_guard<std::mutex> lock(mutex);
+		s.clear();
+		for (auto ce : sol) s.push_back(g.decompress_edge(ce));
+		w = weight;
+		return true;
+	}
+};
+
+// One search of the end_heu portfolio. tmp is the worker's own copy of the
+// solution graph, with the starting solution as its partial_solution. The
+// dreyfus_zid pass of one worker may use all threads: the other workers
+// help with its parallel parts between their own steps.
+void end_heu_worker(Graph& tmp, const std::vector<Vertex>& possible_vertices,
+	PortfolioBest& shared, int worker) {
+	// topology of tmp does not change from now on
+	const CSRGraph csr(tmp);
+	IncrementalVoronoi<CSRGraph> voronoi(csr);
 	int loops = 0;
 	std::unordered_set<size_t> known_solutions;
 
@@ -513,11 +761,7 @@ Graph end_heu(const Graph& g, const std::vector<Vertex>& possible_vertices) {
 	typedef std::vector<Edge> Solution;
 	std::deque< Solution > cur_queue, old_queue;
 
-	std::vector<Edge> sure_edges;
-	Solution best_sol;
-	for (auto e : tmp.partial_solution)
-		(e.is_removed() ? sure_edges : best_sol).push_back(e);
-	tmp.partial_solution = best_sol;
+	Solution best_sol = tmp.partial_solution;
 	Solution orig_sol = best_sol;
 
 	const Weight orig_weight = tmp.partial_solution_weight();
@@ -543,6 +787,7 @@ Graph end_heu(const Graph& g, const std::vector<Vertex>& possible_vertices) {
 			best_sol = sol;
 			best_weight = weight;
 			best_hash = hash;
+			shared.offer(tmp, best_sol, best_weight);
 		}
 
 		known_solutions.insert(hash);
@@ -557,7 +802,7 @@ Graph end_heu(const Graph& g, const std::vector<Vertex>& possible_vertices) {
 
 		Weight w_old = -2;
 		sol.clear();
-		PAUSE_DEBUG weight = refine_solution(tmp, vert, std::back_inserter(sol));
+		PAUSE_DEBUG weight = refine_solution(tmp, voronoi, vert, std::back_inserter(sol));
 		Solution old;
 		std::swap(tmp.partial_solution, old);
 
@@ -565,18 +810,14 @@ Graph end_heu(const Graph& g, const std::vector<Vertex>& possible_vertices) {
 			w_old = weight;
 			std::swap(tmp.partial_solution, sol);
 			sol.clear();
-			PAUSE_DEBUG weight = refine_solution(tmp, {}, std::back_inserter(sol));
+			PAUSE_DEBUG weight = refine_solution(tmp, voronoi, {}, std::back_inserter(sol));
 		}
 		std::swap(tmp.partial_solution, old);
 	};
 
-	{
-		Weight w = 0;
-		for (auto e : sure_edges) w += e.weight();
-		debug_printf("sure_edges weight %d\n", w);
-	}
-
 	static int vert_sizes[] = CONST_VERT_SIZES;
+	// every other worker perturbs with twice as many fake terminals
+	const int vert_scale = 1 + worker % 2;
 
 	Weight dz_last = -1;
 	int tries = 0;
@@ -605,12 +846,18 @@ Graph end_heu(const Graph& g, const std::vector<Vertex>& possible_vertices) {
 
 		while (tries-- > 0) {
 			CHECK_SIGNALS(goto end);
+			ThreadPool::get().help_pending();
 
 			loops++;
 
 			if (loops % 1000 == 1) {
 				vert_size = 0;
 				tries = 0;
+				// take over what the other workers found
+				if (shared.fetch(tmp, best_sol, best_weight)) {
+					boost::sort(best_sol);
+					best_hash = hash_sol(best_sol);
+				}
 				if (dz_last != best_weight || rand() % 100 < 30) {
 					tmp.partial_solution = best_sol;
 					cur_weight = best_weight;
@@ -630,7 +877,16 @@ Graph end_heu(const Graph& g, const std::vector<Vertex>& possible_vertices) {
 				std::swap(tmp.partial_solution, sol);
 				auto S = get_solution_structure(tmp);
 				sol.clear();
-				PAUSE_DEBUG weight = dreyfus_zid(tmp, S, std::back_inserter(sol));
+				weight = -1;
+				// another worker is in dreyfus_zid, try again next time
+				std::unique_lock<std::mutex> dz_lock(shared.dz_mutex, std::try_to_lock);
+				if (dz_lock.owns_lock()) {
+					PAUSE_DEBUG weight = dreyfus_zid(csr, S, std::back_inserter(sol),
+						tmp.partial_solution_weight());
+					dz_lock.unlock();
+				} else {
+					dz_last = -1;
+				}
 				if (weight != -1) {
 					std::swap(tmp.partial_solution, sol);
 					vert_size = 0;
@@ -642,7 +898,7 @@ Graph end_heu(const Graph& g, const std::vector<Vertex>& possible_vertices) {
 				}
 			}
 
-			vert_size = vert_sizes[rand() % (sizeof(vert_sizes)/sizeof(vert_sizes[0]))];
+			vert_size = vert_scale * vert_sizes[rand() % (sizeof(vert_sizes)/sizeof(vert_sizes[0]))];
 
 			step(1);
 
@@ -664,7 +920,7 @@ Graph end_heu(const Graph& g, const std::vector<Vertex>& possible_vertices) {
 			std::swap(cur_queue.front(), tmp.partial_solution);
 			if (rand() % 100 < 40) {
 				debug_printf("Approx + random \n" );
-				greedy_2approx(tmp, std::back_inserter(tmp.partial_solution));
+				greedy_2approx(voronoi, std::back_inserter(tmp.partial_solution));
 				vert_size = 13;
 			} else {
 				tmp.partial_solution = orig_sol;
@@ -677,7 +933,14 @@ Graph end_heu(const Graph& g, const std::vector<Vertex>& possible_vertices) {
 			auto S = get_solution_structure(tmp);
 
 			sol.clear();
-			PAUSE_DEBUG weight = dreyfus_zid(tmp, S, std::back_inserter(sol));
+			weight = -1;
+			// skipped while another worker is in dreyfus_zid
+			std::unique_lock<std::mutex> dz_lock(shared.dz_mutex, std::try_to_lock);
+			if (dz_lock.owns_lock()) {
+				PAUSE_DEBUG weight = dreyfus_zid(csr, S, std::back_inserter(sol),
+					tmp.partial_solution_weight());
+				dz_lock.unlock();
+			}
 			if (weight != -1) {
 				std::swap(tmp.partial_solution, sol);
 				vert_size = 0;
@@ -702,13 +965,56 @@ Graph end_heu(const Graph& g, const std::vector<Vertex>& possible_vertices) {
 	cur_queue.clear();
 	old_queue.clear();
 
+	} TIMER_END("%s %d: %d loops with %zu unique solutions in %lg s\n",
+		__func__, worker, loops, known_solutions.size(), timer);
+}
+
+// Local search on the solution of g until a signal or the timer stops it.
+// Runs a portfolio of thread_count() independent searches, each with its
+// own seed and graph copy, which share the best solution found.
+Graph end_heu(const Graph& g, const std::vector<Vertex>& possible_vertices) {
+	debug_printf("\nCalling %s\n", __func__);
+	Graph tmp = g.get_solution();
+
+	std::vector<Edge> sure_edges, sol;
+	for (auto e : tmp.partial_solution)
+		(e.is_removed() ? sure_edges : sol).push_back(e);
+	tmp.partial_solution = sol;
+
+	{
+		Weight w = 0;
+		for (auto e : sure_edges) w += e.weight();
+		debug_printf("sure_edges weight %d\n", w);
+	}
+
+	Weight weight = tmp.partial_solution_weight();
+	PortfolioBest shared(tmp, sol, weight);
+
+	const int workers = thread_count();
+	std::vector<unsigned> seeds;
+	for (int i = 0; i < workers; i++) seeds.push_back(rand());
+
+	// workers may run on the calling thread, whose random stream and debug
+	// output must be as they were afterwards
+	parallel_for(workers, [&](int i, int) {
+		const bool old_print_debug = print_debug;
+		const std::mt19937_64 old_rand_gen = _rand_gen;
+		print_debug = old_print_debug && i == 0;
+		_rand_gen = std::mt19937_64(seeds[i]);
+
+		Graph copy{tmp, Graph::copy_tag()};
+		end_heu_worker(copy, possible_vertices, shared, i);
+
+		_rand_gen = old_rand_gen;
+		print_debug = old_print_debug;
+	}, 1);
+
+	weight = std::numeric_limits<Weight>::max();
+	shared.fetch(tmp, sol, weight);
 	tmp.partial_solution.clear();
-	clean_up_solution(tmp, best_sol, std::back_inserter(tmp.partial_solution));
+	clean_up_solution(tmp, sol, std::back_inserter(tmp.partial_solution));
 	for (auto e : sure_edges) tmp.partial_solution.push_back(e);
 
-	} TIMER_END("%s: %d loops with %zu unique solutions in %lg s\n",
-		__func__, loops, known_solutions.size(), timer);
-
 	return tmp;
 }
 
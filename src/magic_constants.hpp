@@ -21,4 +21,63 @@
 #define CONST_ABOVE_CURRENT_WEIGHT 1.001
 #endif
 
+#ifndef CONST_RATIO_SNAPSHOT_DIVISOR
+#define CONST_RATIO_SNAPSHOT_DIVISOR 8
+#endif
+
+#ifndef CONST_DIAL_MAX_WEIGHT
+#define CONST_DIAL_MAX_WEIGHT 256
+#endif
+
+// 0 means one per hardware thread
+#ifndef CONST_THREAD_COUNT
+#define CONST_THREAD_COUNT 0
+#endif
+
+#ifndef CONST_PARALLEL_CHUNK
+#define CONST_PARALLEL_CHUNK 64
+#endif
+
+// stale star ratios are recomputed in batches of this size, doubling up
+// to the maximum within a contraction round
+#ifndef CONST_RATIO_BATCH
+#define CONST_RATIO_BATCH 8
+#endif
+
+#ifndef CONST_RATIO_BATCH_MAX
+#define CONST_RATIO_BATCH_MAX 1024
+#endif
+
+// a batch of stale ratios is handed to threads in chunks of this size, so
+// batches of less than two chunks are computed serially
+#ifndef CONST_RATIO_CHUNK
+#define CONST_RATIO_CHUNK 16
+#endif
+
+// for_common_targets gallops when one list is this many times shorter
+#ifndef CONST_GALLOP_RATIO
+#define CONST_GALLOP_RATIO 16
+#endif
+
+// incidence lists longer than this are kept in sorted chunks of a quarter
+// of it, so that edges of hubs are inserted and removed in O(log d + chunk)
+#ifndef CONST_HUB_DEGREE
+#define CONST_HUB_DEGREE 1024
+#endif
+
+// special_distance_test looks at this many nearest terminals of a vertex,
+// popping at most CONST_SD_VISIT_LIMIT vertices to find them
+#ifndef CONST_SD_TERMINALS
+#define CONST_SD_TERMINALS 4
+#endif
+
+#ifndef CONST_SD_VISIT_LIMIT
+#define CONST_SD_VISIT_LIMIT 256
+#endif
+
+// bytes dreyfus_zid may allocate, it gives up on larger instances
+#ifndef CONST_DREYFUS_ZID_MEMORY
+#define CONST_DREYFUS_ZID_MEMORY (2048ull << 20)
+#endif
+
 #endif // MAGIC_CONSTANTS_HPP
@@ -1,27 +1,81 @@
 #ifndef PAAL_GLUE_HPP
 #define PAAL_GLUE_HPP
 
+#include <algorithm>
+
 #include "graph.hpp"
-#include "boost/graph/kruskal_min_spanning_tree.hpp"
+#include "union_find.hpp"
 #include "boost/range/algorithm/sort.hpp"
 #include "boost/range/algorithm/unique.hpp"
 #include "boost/range/algorithm/copy.hpp"
 
-// Heavily modified paal::steiner_tree_greedy
-template < typename OutputIterator >
-void greedy_2approx(const Graph& g, OutputIterator out) {
-	std::vector<Weight> distance(g.vertex_count, std::numeric_limits<Weight>::max());
+// Second half of greedy_2approx: given a Voronoi partition of g by its
+// terminals (distance, the last edge vpred of a shortest path from the
+// nearest terminal, and region(v), the index of that terminal in
+// g.terminals), connects the regions along a minimum spanning tree.
+template < typename G, typename Region, typename OutputIterator >
+void voronoi_steiner_tree(const G& g, const std::vector<Weight>& distance,
+	const std::vector<Edge>& vpred, Region region, OutputIterator out) {
+	// edges between regions, as (distance between terminals, terminals, edge)
+	struct Link {
+		Weight d;
+		int st, tt;
+		int edge;
+	};
+	std::vector<Link> links;
+	for (int i = 0; i < (int)g.edge_list.size(); i++) {
+		auto e = g.edge_list[i];
+		int st = region(e.source());
+		int tt = region(e.target());
+		if (st != tt)
+			links.push_back({ distance[e.source()] + distance[e.target()] + e.weight(), st, tt, i });
+	}
+
+	// Kruskal on the terminal graph, ties broken by edge index
+	std::sort(links.begin(), links.end(), [](const Link& a, const Link& b) {
+		return a.d != b.d ? a.d < b.d : a.edge < b.edge;
+	});
+	std::vector<int> terminal_edges;
+	UnionFind uf(g.terminals.size());
+	for (const auto& l : links) {
+		if (terminal_edges.size() + 1 >= g.terminals.size()) break;
+		if (uf.find(l.st, l.tt)) continue;
+		uf.link(l.st, l.tt);
+		terminal_edges.push_back(l.edge);
+	}
+
+	// computing result
+	std::vector<Edge> tree_edges;
+	for (int i : terminal_edges) {
+		Edge e = g.edge_list[i];
+		tree_edges.push_back(e);
+		for (auto v : { e.source(), e.target() }) {
+			while (g.terminals[region(v)] != v) {
+				tree_edges.push_back(vpred[v]);
+				v = vpred[v].source();
+			}
+		}
+	}
 
-	const auto cmp = [&](Vertex a, Vertex b) { return distance[a] < distance[b]; };
-	Heap<Vertex, decltype(cmp), std::vector<unsigned>, 4> heap{cmp};
-	heap.map.assign(g.vertex_count, heap.not_in_heap);
+	// because in each voronoi region we have unique patch to all vertex from
+	// terminal, result graph contain no cycle
+	// and all leaf are terminal
+	boost::sort(tree_edges);
+	boost::copy(boost::unique(tree_edges), out);
+}
+
+// Heavily modified paal::steiner_tree_greedy
+// G is either Graph or CSRGraph
+template < typename G, typename OutputIterator >
+void greedy_2approx(const G& g, OutputIterator out) {
+	DijkstraWorkspace ws(g);
+	auto& distance = ws.dist;
 
 	std::vector<Vertex> nearest_terminal(g.vertex_count);
 	for (int i = 0; i < (int)g.terminals.size(); i++) {
 		Vertex t = g.terminals[i];
 		nearest_terminal[t] = i;
-		distance[t] = 0;
-		heap.push(t);
+		ws.add_source(t);
 	}
 
 	// compute voronoi diagram each vertex get nearest terminal and last edge on
@@ -29,48 +83,109 @@ void greedy_2approx(const Graph& g, OutputIterator out) {
 	std::vector<Edge> vpred(g.vertex_count);
 
 	Dummy dummy;
-	Dijkstra(g, distance, dummy, heap, dummy,
+	Dijkstra(g, distance, dummy, ws, dummy,
 		[&](Edge e) {
 			nearest_terminal[e.target()] = nearest_terminal[e.source()];
 			vpred[e.target()] = e;
 		}, dummy
 	);
 
-	// computing distances between terminals
-	// creating terminal_graph
-	Graph tmp(g.terminals.size());
-	for (int i = 0; i < (int)g.edge_list.size(); i++) {
-		auto e = g.edge_list[i];
-		Vertex st = nearest_terminal[e.source()];
-		Vertex tt = nearest_terminal[e.target()];
-		if (st != tt) {
-			Weight d = distance[e.source()] + distance[e.target()] + e.weight();
-			tmp.add_edge(st, tt, d, EDGE_EXT_REF, i);
-		}
+	voronoi_steiner_tree(g, distance, vpred,
+		[&](Vertex v) { return nearest_terminal[v]; }, out);
+}
+
+// greedy_2approx for a sequence of terminal sets on a graph whose topology and
+// weights stay the same (as in end_heu, where terminals differ by a few fake
+// ones from call to call). The Voronoi partition is kept between calls: a
+// new terminal claims what it is closer to, and the regions of dropped
+// terminals are refilled from their borders, so a call only searches the
+// part of the graph that changed hands.
+template < typename G >
+struct IncrementalVoronoi {
+	const G& g;
+	std::vector<Weight> dist;
+	std::vector<Vertex> base; // nearest terminal, -1 if none yet
+	std::vector<Edge> vpred;
+	std::vector<Vertex> sources;
+	std::vector<int> index; // of a source in g.terminals
+	std::vector<Vertex> orphans, border;
+	MonotoneHeap<Vertex, DijkstraWorkspace::Key, std::vector<unsigned>> heap;
+
+	explicit IncrementalVoronoi(const G& g) : g(g),
+		dist(g.vertex_count, std::numeric_limits<Weight>::max()),
+		base(g.vertex_count, -1), vpred(g.vertex_count), index(g.vertex_count),
+		heap(DijkstraWorkspace::Key{&dist}, g.max_weight) {
+		heap.map.assign(g.vertex_count, heap.not_in_heap);
 	}
+	IncrementalVoronoi(const IncrementalVoronoi&) = delete;
+	IncrementalVoronoi& operator=(const IncrementalVoronoi&) = delete;
 
-	// computing spanning tree on terminal_graph
-	std::vector<Edge> terminal_edges;
-	boost::kruskal_minimum_spanning_tree(tmp, std::back_inserter(terminal_edges));
+	// brings the partition up to date with g.terminals
+	void update() {
+		// forget the regions of terminals which are gone
+		size_t kept = 0;
+		for (Vertex s : sources) {
+			if (g.is_terminal(s)) {
+				sources[kept++] = s;
+				continue;
+			}
+			size_t first = orphans.size();
+			orphans.push_back(s);
+			base[s] = -1;
+			for (size_t i = first; i < orphans.size(); i++) {
+				for (auto e : incident_edges(g, orphans[i])) {
+					Vertex u = e.target();
+					if (base[u] != s) continue;
+					base[u] = -1;
+					orphans.push_back(u);
+				}
+			}
+		}
+		sources.resize(kept);
+		for (Vertex v : orphans) dist[v] = std::numeric_limits<Weight>::max();
 
-	// computing result
-	std::vector<Edge> tree_edges;
-	for (auto t_edge : terminal_edges) {
-		Edge e = g.edge_list[t_edge.orig_edge()];
-		tree_edges.push_back(e);
-		for (auto v : { e.source(), e.target() }) {
-			while (g.terminals[nearest_terminal[v]] != v) {
-				tree_edges.push_back(vpred[v]);
-				v = vpred[v].source();
+		// they get refilled from their intact neighbours ...
+		for (Vertex v : orphans) {
+			for (auto e : incident_edges(g, v)) {
+				Vertex u = e.target();
+				if (base[u] != -1) border.push_back(u);
 			}
 		}
+		// ... and the new terminals take over what is closer to them
+		for (Vertex t : g.terminals) {
+			if (base[t] == t) continue;
+			dist[t] = 0;
+			base[t] = t;
+			vpred[t] = null_edge;
+			sources.push_back(t);
+			border.push_back(t);
+		}
+		heap.build(border);
+		orphans.clear();
+		border.clear();
+
+		Dijkstra(g, dist, dummy, heap, dummy,
+			[&](Edge e) {
+				base[e.target()] = base[e.source()];
+				vpred[e.target()] = e;
+			}
+		);
+
+		for (int i = 0; i < (int)g.terminals.size(); i++) index[g.terminals[i]] = i;
 	}
 
-	// because in each voronoi region we have unique patch to all vertex from
-	// terminal, result graph contain no cycle
-	// and all leaf are terminal
-	boost::sort(tree_edges);
-	boost::copy(boost::unique(tree_edges), out);
+	template < typename OutputIterator >
+	void steiner_tree(OutputIterator out) {
+		voronoi_steiner_tree(g, dist, vpred,
+			[&](Vertex v) { return index[base[v]]; }, out);
+	}
+};
+
+// same as greedy_2approx(voronoi.g, out)
+template < typename G, typename OutputIterator >
+void greedy_2approx(IncrementalVoronoi<G>& voronoi, OutputIterator out) {
+	voronoi.update();
+	voronoi.steiner_tree(out);
 }
 
 
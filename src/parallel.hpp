@@ -0,0 +1,161 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "magic_constants.hpp"
+
+// number of threads used by parallel_for
+int thread_count() {
+	static const int count = CONST_THREAD_COUNT > 0 ? CONST_THREAD_COUNT :
+		std::max(1u, std::thread::hardware_concurrency());
+	return count;
+}
+
+// thread_count() - 1 threads kept for the whole run, which help with the
+// jobs of parallel_for. A job is run by its caller, which is participant 0,
+// and by up to slots - 1 idle helpers which join it. The caller waits only
+// for helpers already running the job, so parallel_for may be nested: a
+// job nobody helps with is simply run by its caller. Threads busy with a
+// long job may lend a hand to the others through help_pending.
+class ThreadPool {
+public:
+	struct Job {
+		std::function<void(int)> run; // called with the participant number
+		int slots;
+		int next_slot = 1;
+		int running = 0;
+		const Job* parent = nullptr; // the job its caller takes part in
+	};
+
+	static ThreadPool& get() {
+		static ThreadPool pool(thread_count() - 1);
+		return pool;
+	}
+
+	void run(Job& job) {
+		job.parent = current;
+		current = &job;
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!workers.empty() && job.slots > 1) {
+			pending.push_back(&job);
+			pending_count = pending.size();
+			lock.unlock();
+			wake.notify_all();
+			job.run(0);
+			lock.lock();
+			pending.erase(std::remove(pending.begin(), pending.end(), &job), pending.end());
+			pending_count = pending.size();
+			done.wait(lock, [&] { return job.running == 0; });
+		} else {
+			lock.unlock();
+			job.run(0);
+		}
+		current = job.parent;
+	}
+
+	// Runs a share of a pending job the calling thread doesn't take part in
+	// yet, if there is one; returns whether it did.
+	bool help_pending() {
+		if (pending_count == 0) return false;
+		std::unique_lock<std::mutex> lock(mutex);
+		for (Job* job : pending) {
+			if (takes_part(job)) continue;
+			join(job, lock);
+			return true;
+		}
+		return false;
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wake.notify_all();
+		for (auto& t : workers) t.join();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	std::deque<Job*> pending;
+	std::atomic<size_t> pending_count{0};
+	std::vector<std::thread> workers;
+	bool stop = false;
+	// innermost job the thread takes part in
+	static thread_local const Job* current;
+
+	explicit ThreadPool(int count) {
+		for (int i = 0; i < count; i++) workers.emplace_back([this] { help(); });
+	}
+
+	void help() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			wake.wait(lock, [&] { return stop || !pending.empty(); });
+			if (stop) return;
+			join(pending.front(), lock);
+		}
+	}
+
+	bool takes_part(const Job* job) const {
+		for (const Job* j = current; j; j = j->parent)
+			if (j == job) return true;
+		return false;
+	}
+
+	// takes the next slot of a pending job and runs it, lock is held
+	// before and after
+	void join(Job* job, std::unique_lock<std::mutex>& lock) {
+		int slot = job->next_slot++;
+		if (job->next_slot >= job->slots) {
+			pending.erase(std::find(pending.begin(), pending.end(), job));
+			pending_count = pending.size();
+		}
+		job->running++;
+
+		lock.unlock();
+		const Job* outer = current;
+		current = job;
+		job->run(slot);
+		current = outer;
+		lock.lock();
+
+		if (--job->running == 0) done.notify_all();
+	}
+};
+
+thread_local const ThreadPool::Job* ThreadPool::current = nullptr;
+
+// Calls f(i, thread) for every i in [0, n), handing out chunks of indices to
+// up to thread_count() threads of the ThreadPool; less than two chunks are
+// run on the calling thread alone. thread is in [0, thread_count()) and never
+// used by two threads at once within one call, so it can index per-thread
+// scratch space. Nothing may be thrown out of f.
+template < typename F >
+void parallel_for(int n, F f, int chunk = CONST_PARALLEL_CHUNK) {
+	int threads = std::min(thread_count(), (n + chunk - 1) / chunk);
+	if (threads <= 1) {
+		for (int i = 0; i < n; i++) f(i, 0);
+		return;
+	}
+
+	std::atomic<int> next(0);
+	ThreadPool::Job job;
+	job.slots = threads;
+	job.run = [&](int thread) {
+		for (int b; (b = next.fetch_add(chunk)) < n; )
+			for (int i = b; i < std::min(b + chunk, n); i++) f(i, thread);
+	};
+	ThreadPool::get().run(job);
+}
+
+#endif // PARALLEL_HPP
@@ -4,67 +4,146 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cctype>
 
-#include "graph.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define READ_HPP_BUFF_LEN 255
-#define PACE_SECTION_END "END\n"
-#define PACE_TERMINALS_START "SECTION Terminals\n"
+#include "graph.hpp"
 
-void
-read_edges(FILE *fin, Graph *g, size_t nedges, char *buff, size_t buff_len)
-{
-	unsigned int u, v, weight;
-
-	for (; nedges--; ) {
-		fgets(buff, buff_len, fin);
-		//fprintf(stderr, "edge: %s", buff);
-		if (strcmp(buff, PACE_SECTION_END) != 0) {
-			sscanf(buff, "%*c %u %u %u", &u, &v, &weight);
-			g->add_edge(u, v, weight, u, v);
+#define READ_HPP_BLOCK_LEN (1 << 20)
+
+// Whole input in memory: mmapped if it is a regular file, read in large
+// blocks otherwise (pipes, terminals).
+struct InputBuffer {
+	const char *data;
+	size_t size;
+
+	InputBuffer(FILE *fin) : data(nullptr), size(0), mapped(false) {
+		int fd = fileno(fin);
+		struct stat st;
+
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				madvise(p, st.st_size, MADV_SEQUENTIAL);
+				data = (const char*)p;
+				size = st.st_size;
+				mapped = true;
+				return;
+			}
 		}
+
+		ssize_t len;
+		do {
+			buffer.resize(size + READ_HPP_BLOCK_LEN);
+			len = read(fd, &buffer[size], READ_HPP_BLOCK_LEN);
+			if (len > 0) size += len;
+		} while (len > 0);
+		data = buffer.data();
 	}
-}
 
-void
-read_terminals(FILE *fin, Graph *g, char *buff, size_t buff_len)
-{
-	unsigned int terminal;
-	unsigned int nterminals;
+	~InputBuffer() {
+		if (mapped) munmap((void*)data, size);
+	}
+
+private:
+	bool mapped;
+	std::vector<char> buffer;
+};
+
+// Tokenizer for the line based PACE (STP) format.
+struct PaceScanner {
+	const char *p;
+	const char *end;
 
-	while (true) {
-		fgets(buff, buff_len, fin);
-		if (strcmp(buff, PACE_TERMINALS_START) == 0)
-			break;
+	PaceScanner(const InputBuffer& in) : p(in.data), end(in.data + in.size) {}
+
+	bool eof() const { return p >= end; }
+
+	void skip_blanks() {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
 	}
 
-	fgets(buff, buff_len, fin);
-	sscanf(buff, "%*s %u", &nterminals);
+	void next_line() {
+		const char *nl = (const char*)memchr(p, '\n', end - p);
+		p = nl ? nl + 1 : end;
+	}
 
-	for (; nterminals--; ) {
-		fgets(buff, buff_len, fin);
-		if (strcmp(buff, PACE_SECTION_END) != 0) {
-			sscanf(buff, "%*c %u", &terminal);
-			g->mark_terminal(terminal);
+	// returns true if the next token on the current line is word
+	bool word(const char *w) {
+		skip_blanks();
+		size_t len = strlen(w);
+		if ((size_t)(end - p) < len || memcmp(p, w, len) != 0) return false;
+		if (p + len < end && !isspace((unsigned char)p[len])) return false;
+		p += len;
+		return true;
+	}
+
+	unsigned number() {
+		skip_blanks();
+		unsigned x = 0;
+		for (unsigned d; p < end && (d = (unsigned)(*p - '0')) < 10; p++)
+			x = 10 * x + d;
+		return x;
+	}
+
+	void skip_section() {
+		while (!eof()) {
+			bool end_found = word("END");
+			next_line();
+			if (end_found) return;
 		}
 	}
-}
+};
 
 Graph graph_from_file(FILE *fin)
 {
-	unsigned int nvert = 0, nedges = 0;
-	char buff[READ_HPP_BUFF_LEN];
-
-	fgets(buff, READ_HPP_BUFF_LEN, fin);
-	fgets(buff, READ_HPP_BUFF_LEN, fin);
-	sscanf(buff, "%*s %u", &nvert);
-	fgets(buff, READ_HPP_BUFF_LEN, fin);
-	sscanf(buff, "%*s %u", &nedges);
+	unsigned int nvert = 0;
+	std::vector<OriginalEdge> edges;
+	std::vector<Vertex> terminals;
+
+	{
+		InputBuffer in(fin);
+		PaceScanner sc(in);
+
+		// sections may come in any order; anything we do not understand
+		// (comments, headers, the tree decomposition) is skipped
+		while (!sc.eof()) {
+			if (sc.word("E")) {
+				unsigned u = sc.number(), v = sc.number(), w = sc.number();
+				edges.emplace_back(u, v, w);
+			} else if (sc.word("T")) {
+				terminals.push_back(sc.number());
+			} else if (sc.word("Nodes")) {
+				nvert = sc.number();
+			} else if (sc.word("Edges")) {
+				edges.reserve(sc.number());
+			} else if (sc.word("SECTION")) {
+				if (!sc.word("Graph") && !sc.word("Terminals")) {
+					sc.skip_section();
+					continue;
+				}
+			} else if (sc.word("EOF")) {
+				break;
+			}
+			sc.next_line();
+		}
+	}
 
 	Graph g(nvert + 1);
 
-	read_edges(fin, &g, nedges, buff, READ_HPP_BUFF_LEN);
-	read_terminals(fin, &g, buff, READ_HPP_BUFF_LEN);
+	for (auto& e : edges)
+		Assert(std::get<0>(e) <= (int)nvert && std::get<1>(e) <= (int)nvert,
+			"Edge (%d, %d) out of range\n", std::get<0>(e), std::get<1>(e));
+	g.add_edges(edges);
+
+	for (auto t : terminals) {
+		Assert(t <= (int)nvert, "Terminal %d out of range\n", t);
+		g.mark_terminal(t);
+	}
 
 	g.save_orig_graph();
 
@@ -73,4 +152,3 @@ Graph graph_from_file(FILE *fin)
 }
 
 #endif // READ_HPP
-
@@ -0,0 +1,111 @@
+#ifndef SDIST_HPP
+#define SDIST_HPP
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "graph.hpp"
+#include "union_find.hpp"
+#include "paal_glue.hpp"
+#include "parallel.hpp"
+
+// Bottleneck Steiner distance test.
+//
+// The special distance s(u, v) is the least, over u-v paths, of the longest
+// piece such a path is cut into by its terminals. An edge (u, v) with
+// s(u, v) < w(u, v) is in no minimum Steiner tree: removing it splits the
+// tree and some piece of the path reconnects it for less. Such edges are
+// found on a snapshot and deleted together.
+//
+// The bound used is s(u, v) <= max(d(u, t1), b(t1, t2), d(t2, v)), for t1 among
+// the CONST_SD_TERMINALS nearest terminals of u, t2 among those of v, and
+// b(t1, t2) the exact special distance between terminals, which is the
+// bottleneck of their path in the minimum spanning tree of the distance
+// network. The edges are tested in order of weight while the network edges
+// lighter than the current one are joined in a union-find, so b(t1, t2) < w
+// is a single find.
+void special_distance_test(Graph& g) {
+	if (g.terminals.size() < 2) return;
+	unsigned count = 0;
+
+	TIMER_BEGIN {
+		const CSRGraph csr(g);
+
+		// distance network between terminals, from the Voronoi regions
+		IncrementalVoronoi<CSRGraph> voronoi(csr);
+		voronoi.update();
+		struct Link {
+			Weight d;
+			int st, tt;
+		};
+		std::vector<Link> links;
+		for (auto e : csr.edge_list) {
+			Vertex s = voronoi.base[e.source()], t = voronoi.base[e.target()];
+			if (s == -1 || t == -1 || s == t) continue;
+			links.push_back({ voronoi.dist[e.source()] + e.weight() + voronoi.dist[e.target()],
+				voronoi.index[s], voronoi.index[t] });
+		}
+		std::sort(links.begin(), links.end(),
+			[](const Link& a, const Link& b) { return a.d < b.d; });
+
+		// nearest terminals of every vertex closer than its heaviest edge;
+		// a terminal hides those behind it, so the searches stop there
+		struct Near {
+			Weight d;
+			int t; // index in g.terminals, -1 if unused
+		};
+		const int K = CONST_SD_TERMINALS;
+		std::vector<Near> nearest(csr.vertex_count * K, Near{0, -1});
+
+		std::vector< std::unique_ptr<DijkstraWorkspace> > scratch;
+		for (int i = 0; i < thread_count(); i++) scratch.emplace_back(new DijkstraWorkspace(csr));
+
+		parallel_for(csr.vertex_count, [&](Vertex u, int thread) {
+			DijkstraWorkspace& ws = *scratch[thread];
+			Weight radius = -1;
+			for (auto e : csr.arcs(u)) radius = std::max(radius, e.weight() - 1);
+			if (radius < 0) return;
+
+			ws.reset();
+			ws.add_source(u);
+			Near* near = &nearest[u * K];
+			int found = 0, popped = 0;
+			Dijkstra(csr, ws.dist, dummy, ws,
+				[&](Vertex v) {
+					if (ws.dist[v] > radius || ++popped > CONST_SD_VISIT_LIMIT) return Visit::Stop;
+					if (!csr.is_terminal(v)) return Visit::Continue;
+					near[found++] = Near{ ws.dist[v], voronoi.index[v] };
+					return found == K ? Visit::Stop : Visit::Prune;
+				}
+			);
+		});
+
+		std::vector<Edge> edges(csr.edge_list.begin(), csr.edge_list.end());
+		std::sort(edges.begin(), edges.end(), [](Edge e, Edge f) {
+			return e.weight() != f.weight() ? e.weight() < f.weight() : e < f;
+		});
+
+		UnionFind uf(csr.terminals.size());
+		std::vector<Edge> to_remove;
+		size_t l = 0;
+		for (auto e : edges) {
+			Weight w = e.weight();
+			for (; l < links.size() && links[l].d < w; l++) uf.link(links[l].st, links[l].tt);
+
+			const Near* a = &nearest[e.source() * K];
+			const Near* b = &nearest[e.target() * K];
+			bool shorter = false;
+			for (int i = 0; i < K && a[i].t != -1 && a[i].d < w && !shorter; i++)
+				for (int j = 0; j < K && b[j].t != -1 && b[j].d < w && !shorter; j++)
+					shorter = uf.find(a[i].t, b[j].t);
+			if (shorter) to_remove.push_back(e);
+		}
+
+		for (auto e : to_remove)
+			count += g.remove_edge(e);
+
+	} TIMER_END("  %s: deleted %u edges in %lg s\n", __func__, count, timer);
+}
+
+#endif // SDIST_HPP
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <signal.h>
+#include <random>
+#include <set>
+
+#include "graph.hpp"
+
+volatile sig_atomic_t g_stop_signal = 0;
+
+// Runs special_distance_test on random small graphs and checks that the
+// weight of a minimum Steiner tree, found by brute force, doesn't change.
+// Half of the graphs have zero weight edges, which make ties between the
+// deleted edge and the path replacing it.
+
+// minimum spanning forest of the terminals and every subset of the Steiner
+// vertices, keeping the lightest one that connects its vertices
+long long steiner_tree_weight(const Graph& g) {
+	std::vector<Vertex> steiner;
+	for (Vertex v = 0; v < g.vertex_count; v++)
+		if (!g.is_terminal(v) && g.degrees[v] > 0) steiner.push_back(v);
+
+	std::vector<Edge> edges = g.edge_list;
+	std::sort(edges.begin(), edges.end(),
+		[](Edge e, Edge f) { return e.weight() < f.weight(); });
+
+	long long best = std::numeric_limits<long long>::max();
+	for (unsigned mask = 0; mask < (1u << steiner.size()); mask++) {
+		std::vector<char> in(g.terminal_mask.begin(), g.terminal_mask.end());
+		int components = g.terminal_count;
+		for (size_t i = 0; i < steiner.size(); i++) {
+			if (mask >> i & 1) { in[steiner[i]] = 1; components++; }
+		}
+
+		UnionFind uf(g.vertex_count);
+		long long w = 0;
+		for (auto e : edges) {
+			if (!in[e.source()] || !in[e.target()] || uf.find(e.source(), e.target())) continue;
+			uf.link(e.source(), e.target());
+			w += e.weight();
+			components--;
+		}
+		if (components == 1) best = std::min(best, w);
+	}
+	return best;
+}
+
+int main(int argc, char* argv[]) {
+	int runs = argc > 1 ? atoi(argv[1]) : 1800;
+	std::mt19937 rng(1);
+	int failed = 0, deleted = 0;
+
+	for (int run = 0; run < runs; run++) {
+		int n = 5 + rng() % 10;
+		int k = 2 + rng() % 4;
+		int max_weight = 1 + rng() % 6;
+		Graph g(n);
+		std::set<std::pair<int, int>> seen;
+		// a random tree, so that the graph is connected, and some more edges
+		for (int v = 1; v < n; v++) seen.insert({ (int)(rng() % v), v });
+		for (int i = rng() % (2 * n); i > 0; i--) {
+			int s = rng() % n, t = rng() % n;
+			if (s != t) seen.insert({ std::min(s, t), std::max(s, t) });
+		}
+		for (auto p : seen) {
+			int w = rng() % (max_weight + 1) + run % 2;
+			g.add_edge(p.first, p.second, w, p.first, p.second);
+		}
+		std::vector<Vertex> order(n);
+		for (int i = 0; i < n; i++) order[i] = i;
+		std::shuffle(order.begin(), order.end(), rng);
+		for (int i = 0; i < k; i++) g.mark_terminal(order[i]);
+
+		long long before = steiner_tree_weight(g);
+		int edges = g.edge_count;
+		PAUSE_DEBUG {
+			special_distance_test(g);
+		}
+		deleted += edges - g.edge_count;
+		long long after = steiner_tree_weight(g);
+
+		if (before != after) {
+			printf("run %d: %d vertices, %d terminals: weight %lld before, %lld after\n",
+				run, n, k, before, after);
+			failed++;
+		}
+	}
+
+	printf("%d of %d runs failed, %d edges deleted\n", failed, runs, deleted);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,19 +1,18 @@
 #include <stdlib.h>
 #include <iostream>
+#include <queue>
 
 #include "graph.hpp"
 #include "read.hpp"
-#include "boost/graph/dijkstra_shortest_paths_no_color_map.hpp"
 #include "heuristics.hpp"
 #include "paal_glue.hpp"
+#include "parallel.hpp"
 
 #include <signal.h>
 extern volatile sig_atomic_t g_stop_signal;
 
 using namespace boost;
 
-//struct EarlyTerminate : public std::exception {};
-
 struct Star {
 	int center;
 	std::vector<int> terminals;
@@ -32,18 +31,21 @@ struct Ratio {
 		}
 	}
 
+	// a ratio without work is infinite, whatever its weight; all infinite
+	// ratios are equal
 	bool operator<(const Ratio& r) const {
+		if (work() == 0 || r.work() == 0) return work() != 0 && r.work() == 0;
 		return weight * r.work() < r.weight * work();
 	}
 	bool operator<(long long x) const {
-		return weight < x*work();
+		return work() != 0 && weight < x*work();
 	}
 
 	bool operator>(const Ratio& r) {
 		return r < *this;
 	}
 	bool operator>(long long x) {
-		return weight > x*work();
+		return work() == 0 || weight > x*work();
 	}
 
 	bool operator<=(const Ratio& r) {
@@ -69,103 +71,28 @@ struct Ratio {
 	}
 
 	bool operator==(const Ratio& r) {
-		return weight*r.work() == r.weight*work();
+		return !(*this < r) && !(r < *this);
 	}
 };
 
 
-struct ratio_counting_visitor : public dijkstra_visitor<> {
-	std::vector<int>& dist;
-	Ratio& ratio;
-
-	ratio_counting_visitor(std::vector<int>& dist, Ratio& ratio) : dist(dist), ratio(ratio) { }
-
-	inline void examine_vertex(int v, const Graph& g) {
-		if( ratio.work() >= 1 && ratio <= dist[v] ) {
-			//fprintf(stderr, "    Current ratio %lld/%d, vertex %d at dist %d, terminating\n", ratio.weight, ratio.work(), v, dist[v]);
-			throw EarlyTerminate();
-		}
-
-		if(g.terminal_mask[v]) {
-			//fprintf(stderr, "    Adding terminal %d at dist %d to star; ", v, dist[v]);
-			ratio.weight += dist[v];
-			ratio.terminal_count++;
-			//fprintf(stderr, "Current ratio %lld/%d\n", ratio.weight, ratio.work());
-		}
-	}
-};
-
-
-struct best_star_visitor : public dijkstra_visitor<> {
-
-	std::vector<int>& dist;
-	std::vector<Edge>& pred_edge;
-
-	Ratio& best_ratio;
-	std::vector<Ratio>& best_ratio_at;
-	Star& result;
-
-	bool &star_completed;
-	Ratio &current_ratio;
-
-	best_star_visitor(
-			std::vector<int>& dist,
-			std::vector<Edge>& pred_edge,
-			Ratio& best_ratio,
-			std::vector<Ratio>& best_ratio_at,
-			Star& result,
-			bool& sc,
-			Ratio& real_ratio
-			) :
-		dist(dist),
-		pred_edge(pred_edge),
-		best_ratio(best_ratio),
-		best_ratio_at(best_ratio_at),
-		result(result),
-		star_completed(sc),
-		current_ratio(real_ratio)
-	{
-		star_completed = false;
-		current_ratio.weight = 0;
-		current_ratio.terminal_count = 0;
-	}
-
-	inline void examine_vertex(int v, const Graph& g) {
-		if (! star_completed ) {
-			if ( g.terminal_mask[v] ) {
-				//fprintf(stderr, "Adding terminal %d at disance %d to star\n", v, dist[v]);
-				result.terminals.push_back(v);
-
-				current_ratio.weight += dist[v];
-				current_ratio.terminal_count++;
-
-				//fprintf(stderr, "at %d; current_ratio = %lld/%d, best_ratio = %lld/%d\n", v, current_ratio.weight, current_ratio.work(), best_ratio.weight, best_ratio.work());
+// Buys the union of the shortest paths from the center to the terminals of
+// the star, i.e. a subtree of the tree find_star recorded in pred_edge. The
+// walk clears pred_edge behind itself, so that shared parts of the paths are
+// visited once. Returns the vertex the star got contracted to.
+Vertex contract_star(Graph& g, const Star& s, std::vector<Edge>& pred_edge) {
+	std::vector<Edge> edges_to_contract;
 
-				if( current_ratio.work() > 0 && current_ratio <= best_ratio) {
-					star_completed = true;
-				}
-			}
+	for (Vertex t : s.terminals) {
+		Vertex v = t;
+		while (v != s.center && pred_edge[v] != null_edge) {
+			Edge e = pred_edge[v];
+			pred_edge[v] = null_edge;
+			edges_to_contract.push_back(e);
+			v = e.source();
 		}
 	}
 
-	inline void edge_relaxed(Edge e, const Graph& g) {
-		pred_edge[target(e,g)] = e;
-	}
-};
-
-
-
-
-
-Vertex contract_star(Graph& g, Star& s) {
-	std::vector<Edge> edges_to_contract;
-
-	s.terminals.push_back(s.center);
-	// UGLY DIRTY HACK !!!
-	std::swap(s.terminals, g.terminals);
-	greedy_2approx(g, std::back_inserter(edges_to_contract));
-	std::swap(s.terminals, g.terminals);
-
 	Vertex ret = -1;
 	for(auto e : edges_to_contract) {
 		ret = g.buy_edge(e);
@@ -175,57 +102,60 @@ Vertex contract_star(Graph& g, Star& s) {
 
 
 
-Ratio find_best_ratio_at(Graph& g, int center) {
-	std::vector<int> dist(num_vertices(g));
-
-	iterator_property_map< std::vector<int>::iterator,
-			property_map<Graph, vertex_index_t>::const_type >
-		dist_pm(dist.begin(), get(vertex_index, g));
+// G is either Graph or CSRGraph
+template < typename G >
+Ratio find_best_ratio_at(const G& g, int center, DijkstraWorkspace& ws) {
+	auto& dist = ws.dist;
 
+	Ratio ratio;
+	ratio.terminal_count = 0;
+	ratio.weight = 0;
 
-	Ratio init_ratio;
-	init_ratio.terminal_count = 0;
-	init_ratio.weight = 0;
+	ws.reset();
+	ws.add_source(center);
+	Dijkstra(g, dist, dummy, ws, [&](Vertex v) {
+		if (ratio.work() >= 1 && ratio <= dist[v]) return Visit::Stop;
 
-	ratio_counting_visitor rv(dist, init_ratio);
-
-	try {
-		dijkstra_shortest_paths_no_color_map(g, center,
-			distance_map(dist_pm).
-			visitor(rv) );
-	}
-	catch (EarlyTerminate e) {
-	}
+		if (g.is_terminal(v)) {
+			ratio.weight += dist[v];
+			ratio.terminal_count++;
+		}
+		return Visit::Continue;
+	});
 
-	return rv.ratio;
+	return ratio;
 }
 
 
 void find_star(
 		Graph& g,
+		DijkstraWorkspace& ws,
 		std::vector<Edge>& pred_edge,
 		Ratio& best_ratio,
 		int center,
-		std::vector<Ratio>& best_ratio_at,
 		Star& result) {
 
-	bool completed;
+	auto& dist = ws.dist;
 	Ratio real_ratio;
-	std::vector<int> dist(g.vertex_count);
-
-	best_star_visitor bv(dist,
-			pred_edge,
-			best_ratio,
-			best_ratio_at,
-			result,
-			completed,
-			real_ratio
-			);
+	real_ratio.weight = 0;
+	real_ratio.terminal_count = 0;
 	result.center = center;
 
-	dijkstra_shortest_paths_no_color_map(g, center,
-		distance_map(&dist[0]).
-		visitor(bv) );
+	ws.reset();
+	ws.add_source(center);
+	Dijkstra(g, dist, dummy, ws,
+		[&](Vertex v) {
+			if (!g.is_terminal(v)) return Visit::Continue;
+			result.terminals.push_back(v);
+			real_ratio.weight += dist[v];
+			real_ratio.terminal_count++;
+
+			// the star is complete as soon as it is as good as promised
+			if (real_ratio.work() > 0 && real_ratio <= best_ratio) return Visit::Stop;
+			return Visit::Continue;
+		},
+		[&](Edge e) { pred_edge[e.target()] = e; }
+	);
 
 #ifdef NDEBUG
 	if (false) debug_printf(
@@ -239,6 +169,88 @@ void find_star(
 }
 
 
+// Star centers ordered by their best ratio. The ratio of a center close to
+// a contracted star is stale: its key is then only a lower bound, the old
+// ratio or the distance to the contracted vertex, whichever is smaller.
+// Equal keys pop stale entries first, then smaller centers, so taking the
+// first valid entry finds the same minimum as scanning all centers.
+struct RatioQueue {
+	struct Entry {
+		Ratio key;
+		bool stale;
+		Vertex v;
+		unsigned version;
+	};
+	struct Worse {
+		bool operator()(const Entry& a, const Entry& b) const {
+			if (b.key < a.key) return true;
+			if (a.key < b.key) return false;
+			if (a.stale != b.stale) return b.stale;
+			return a.v > b.v;
+		}
+	};
+
+	std::priority_queue<Entry, std::vector<Entry>, Worse> queue;
+	std::vector<Ratio> key;
+	std::vector<char> stale;
+	std::vector<unsigned> version;
+	int stale_count;
+	// no finite key was ever larger, so invalidate() leaves the keys of
+	// centers further than this from a contracted star as they are. Infinite
+	// keys stay so, as their centers see less than two terminals.
+	Ratio max_key;
+
+	// all centers start stale with key 0
+	RatioQueue(int n) : key(n), stale(n, true), version(n, 0), stale_count(n) {
+		max_key.weight = 0;
+		max_key.terminal_count = 2;
+		for (Vertex v = 0; v < n; v++) {
+			key[v].weight = 0;
+			key[v].terminal_count = 2;
+			queue.push({key[v], true, v, 0});
+		}
+	}
+
+	// drops outdated entries on the way
+	bool empty() {
+		while (!queue.empty() && queue.top().version != version[queue.top().v])
+			queue.pop();
+		return queue.empty();
+	}
+	// call only after !empty()
+	const Entry& top() const { return queue.top(); }
+	void pop() { queue.pop(); }
+
+	// v is gone from the graph
+	void remove(Vertex v) {
+		if (stale[v]) stale_count--;
+		stale[v] = false;
+		version[v]++;
+	}
+
+	void set(Vertex v, Ratio r) {
+		if (stale[v]) stale_count--;
+		stale[v] = false;
+		key[v] = r;
+		if (r.work() > 0 && max_key < r) max_key = r;
+		queue.push({r, false, v, ++version[v]});
+	}
+
+	// v is at distance d from a newly contracted star
+	void invalidate(Vertex v, Weight d) {
+		Ratio r;
+		r.weight = d;
+		r.terminal_count = 2;
+		if (key[v] < r || (stale[v] && !(r < key[v]))) return;
+
+		if (!stale[v]) stale_count++;
+		stale[v] = true;
+		key[v] = r;
+		queue.push({r, true, v, ++version[v]});
+	}
+};
+
+
 void contract_till_the_bitter_end(Graph& g) {
 
 	int n = g.vertex_count;
@@ -248,15 +260,16 @@ void contract_till_the_bitter_end(Graph& g) {
 	inf_ratio.terminal_count = 0;
 
 	std::vector<Ratio> best_ratio_at(n, inf_ratio);
-	std::vector<bool> ratio_invalid(n, true);
+	RatioQueue ratios(n);
 
 	Ratio best_ratio;
 	int best_ratio_center;
 
-	std::vector<Weight> dist(g.vertex_count);
-	const auto cmp = [&](Vertex a, Vertex b) { return dist[a] < dist[b]; };
-	Heap<Vertex, decltype(cmp), std::vector<unsigned>, 4> heap{cmp};
-	heap.map.assign(g.vertex_count, heap.not_in_heap);
+	DijkstraWorkspace ws(g);
+	std::vector< std::unique_ptr<DijkstraWorkspace> > thread_ws;
+	for (int i = 0; i < thread_count(); i++) thread_ws.emplace_back(new DijkstraWorkspace(g));
+	std::vector<Vertex> batch;
+	std::vector<Edge> pred_edge(n, null_edge);
 
 	int round = 1;
 
@@ -268,28 +281,49 @@ void contract_till_the_bitter_end(Graph& g) {
 		best_ratio = inf_ratio;
 		best_ratio_center = n;
 
-		int isolated_counter = 0;
-		for (int i = 0; i < n; i++) {
+		// searching the flat snapshot pays off once it is built only when
+		// many stale ratios may have to be recomputed this round
+		std::unique_ptr<const CSRGraph> csr;
+		if (ratios.stale_count > n / CONST_RATIO_SNAPSHOT_DIVISOR)
+			csr.reset(new CSRGraph(g));
+
+		// recompute stale ratios from the top until a valid one is on top;
+		// they are taken in batches computed in parallel, growing within the
+		// round. Batches smaller than two chunks run on this thread. Batch
+		// sizes do not depend on the thread count, so neither do the results.
+		size_t batch_size = CONST_RATIO_BATCH;
+		while (!ratios.empty()) {
 			CHECK_SIGNALS(goto interrupted);
 
-			if( g.degrees[i] == 0) {
-				isolated_counter++;
-				//fprintf(stderr, "  Vertex %d skipped (contraction orphan)\n", i);
+			const auto& top = ratios.top();
+			if (g.degrees[top.v] == 0) {
+				ratios.remove(top.v);
 				continue;
 			}
-			if( ratio_invalid[i]) {
-				invalid_ratio_count++;
-				//fprintf(stderr, "  Recomputing ratio at %d\n", i);
-				best_ratio_at[i] = find_best_ratio_at(g, i);
-				ratio_invalid[i] = false;
+			if (!top.stale) {
+				best_ratio_center = top.v;
+				best_ratio = best_ratio_at[top.v];
+				break;
 			}
 
-			if(best_ratio_at[i] < best_ratio) {
-				best_ratio_center = i;
-				best_ratio = best_ratio_at[i];
+			batch.clear();
+			while (batch.size() < batch_size && !ratios.empty() && ratios.top().stale) {
+				Vertex v = ratios.top().v;
+				ratios.pop();
+				if (g.degrees[v] == 0) ratios.remove(v);
+				else batch.push_back(v);
 			}
+
+			parallel_for(batch.size(), [&](int i, int thread) {
+				Vertex v = batch[i];
+				best_ratio_at[v] = csr ? find_best_ratio_at(*csr, v, *thread_ws[thread]) :
+					find_best_ratio_at(g, v, *thread_ws[thread]);
+			}, CONST_RATIO_CHUNK);
+
+			for (auto v : batch) ratios.set(v, best_ratio_at[v]);
+			invalid_ratio_count += batch.size();
+			batch_size = std::min(2 * batch_size, (size_t)CONST_RATIO_BATCH_MAX);
 		}
-		debug_printf("Found %d isolated vertices\n", isolated_counter);
 
 		CHECK_SIGNALS(goto interrupted);
 
@@ -297,24 +331,23 @@ void contract_till_the_bitter_end(Graph& g) {
 		debug_printf("Best ratio is %lld/%d, centered at %d\n", best_ratio.weight, best_ratio.work(), best_ratio_center);
 
 		Star s;
-		std::vector<Edge> pred_edge(n,null_edge);
-		// find star; also invalidates ratios at centers too close to this star
 		debug_printf("Finding the best star... ");
-		find_star(g, pred_edge, best_ratio, best_ratio_center, best_ratio_at, s);
+		find_star(g, ws, pred_edge, best_ratio, best_ratio_center, s);
 		// contract star
 		debug_printf("Done\n");
 		debug_printf("Star with %zu terminals\n", s.terminals.size());
 		debug_printf("Contracting... ");
-		Vertex c = contract_star(g, s);
+		Vertex c = contract_star(g, s, pred_edge);
 		assert(c != -1);
 		assert(c != -2);
 
-		dist.assign(g.vertex_count, std::numeric_limits<Weight>::max());
-		dist[c] = 0;
-		heap.push(c);
-		Dijkstra(g, dist, dummy, heap, [&](Vertex v){
-			if (best_ratio_at[v] >= dist[v])
-				ratio_invalid[v] = true;
+		// invalidate ratios at centers too close to the contracted star
+		ws.reset();
+		ws.add_source(c);
+		Dijkstra(g, ws.dist, dummy, ws, [&](Vertex v){
+			if (ratios.max_key < ws.dist[v]) return Visit::Stop;
+			ratios.invalidate(v, ws.dist[v]);
+			return Visit::Continue;
 		});
 
 		debug_printf("Done\n");
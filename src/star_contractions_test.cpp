@@ -4,6 +4,7 @@
 #include <signal.h>
 
 #include "read.hpp"
+#include "cache.hpp"
 #include "star_contractions.hpp"
 
 volatile sig_atomic_t g_stop_signal = 0;
@@ -28,12 +29,23 @@ int main(int argc, char** argv) {
 	debug_printf("Graph loaded\n");
 	debug_printf("|V| = %d, |E| = %d, |R| = %d\n", g.vertex_count, g.edge_count, g.terminal_count);
 
-	debug_printf("First clearance of the input. Calling buy_zero and run_all_heuristics.\n");
-	buy_zero(g);
-	run_all_heuristics(g);
+	// optional third argument: file caching the reduced instance
+	const char *cache = argc >= 4 ? argv[3] : nullptr;
+	const uint64_t fingerprint = graph_fingerprint(g);
 
-	g.compress_graph();
-	g.save_orig_graph();
+	if (cache && load_reduced_graph(cache, fingerprint, g)) {
+		debug_printf("Reduced graph loaded from %s\n", cache);
+	} else {
+		debug_printf("First clearance of the input. Calling buy_zero and run_all_heuristics.\n");
+		buy_zero(g);
+		run_all_heuristics(g);
+
+		g.compress_graph();
+		g.save_orig_graph();
+
+		if (cache) save_reduced_graph(cache, fingerprint, g);
+	}
+	debug_printf("|V| = %d, |E| = %d, |R| = %d\n", g.vertex_count, g.edge_count, g.terminal_count);
 
 	std::vector<Vertex> possible_vertices;
 	for (Vertex v = 0; v < g.vertex_count; v++)
@@ -4,93 +4,12 @@
 #include <vector>
 
 #include "graph.hpp"
+#include "union_find.hpp"
+#include "paal_glue.hpp"
 
 
-struct EarlyTerminate : public std::exception {};
-
 using namespace boost;
 
-struct UnionFind {
-	int size;
-
-	int label(int u);
-	int root(int u);
-	bool find(int u, int v);
-	int link(int u, int v);
-
-	int get_size(int u);
-	bool is_root(int u);
-
-	std::vector<int> parent;
-	std::vector<int> rank;
-	std::vector<int> class_size;
-
-	UnionFind(int size);
-};
-
-
-UnionFind::UnionFind(int size) :
-	rank(size,0),
-	class_size(size,1)
-{
-	this->size = size;
-	parent.resize(size);
-	for(int i = 0; i < size; i++) {
-		parent[i] = i + size;
-	}
-}
-
-bool UnionFind::is_root(int u) {
-	return parent[u] >= size;
-}
-
-int UnionFind::root(int u) {
-	std::vector<int> to_compress;
-	while( !is_root(u) ) {
-		to_compress.push_back(u);
-		u = parent[u];
-	}
-	for(auto v: to_compress) {
-		parent[v] = u;
-	}
-	return u;
-}
-
-int UnionFind::get_size(int u) {
-	return class_size[root(u)];
-}
-
-int UnionFind::label(int u) {
-	return parent[root(u)] - size;
-}
-
-
-bool UnionFind::find(int u, int v) {
-	return root(u) == root(v);
-}
-
-int UnionFind::link(int u, int v) {
-	int ur = root(u);
-	int vr = root(v);
-	if(ur == vr) {
-		return ur;
-	}
-
-	if( rank[ur] > rank[vr] ) {
-		std::swap(ur,vr);
-	}
-
-	parent[ur] = vr;
-
-	class_size[vr] += class_size[ur];
-	if( rank[ur] == rank[vr] ) {
-		rank[vr]++;
-	}
-
-	return vr;
-}
-
-
 struct IncrementalBridgeConnComponents {
 	int size;
 
@@ -115,14 +34,17 @@ struct IncrementalBridgeConnComponents {
 	IncrementalBridgeConnComponents(int size);
 private:
 	int find_lca(int bcu, int bcv);
-	std::vector<bool> visited;
+	// visited[x] == epoch iff find_lca visited x in the current call
+	std::vector<unsigned> visited;
+	unsigned epoch;
 };
 IncrementalBridgeConnComponents::IncrementalBridgeConnComponents(int size) :
 	components(size),
 	bridge_conn_components(size),
 	parent_bc(size,-1),
 	parent_edge(size, null_edge),
-	visited(size,false)
+	visited(size, 0),
+	epoch(0)
 {
 	this->size = size;
 }
@@ -250,56 +172,42 @@ std::vector<Edge> IncrementalBridgeConnComponents::link(Edge e) {
 	return removed_bridges;
 }
 
+// Walks up from both components in turns, marking every component on
+// arrival, until one side arrives where the other has been. Both sides pass
+// the lca before any component above it, so that is where they meet, and the
+// walk is at most twice as long as the paths to the lca, which get condensed
+// right after. Marks are stamped with the number of the call, so that
+// nothing has to be cleared.
 int IncrementalBridgeConnComponents::find_lca(int bcu, int bcv) {
-	int bcu_start = bcu;
-	int bcv_start = bcv;
+	if (++epoch == 0) {
+		std::fill(visited.begin(), visited.end(), 0);
+		epoch = 1;
+	}
+
 	int lca = -1;
-	while(true) {
+	visited[bcu] = epoch;
+	if(visited[bcv] == epoch) {
+		lca = bcv;
+	}
+	visited[bcv] = epoch;
+
+	// a side never arrives at its own marks, as it only walks up
+	while(lca == -1) {
 		debug_printf("bcu = %d, bcv = %d\n", bcu, bcv);
 		debug_printf("parent_bc[bcu] = %d, parent_bc[bcv] = %d\n", parent_bc[bcu], parent_bc[bcv]);
-		if(get_parent_bc(bcu) != -1) {
-			visited[bcu] = true;
-			bcu = get_parent_bc(bcu); 
-			if(visited[bcu]) {
-				lca = bcu;
+		for(int* bcx : {&bcu, &bcv}) {
+			if(get_parent_bc(*bcx) == -1) continue;
+			*bcx = get_parent_bc(*bcx);
+			if(visited[*bcx] == epoch) {
+				lca = *bcx;
 				break;
 			}
-		}
-		if(get_parent_bc(bcv) != -1) {
-			visited[bcv] = true;
-			bcv = get_parent_bc(bcv);
-			if(visited[bcv]) {
-				lca = bcv;
-				break;
-			}
-		}
-
-		if(bcu == bcv) { // since root does not get marked
-			lca = bcu;
-			break;
+			visited[*bcx] = epoch;
 		}
 	}
 
 	debug_printf("lca is = %d\n", lca);
 
-	for(int x : {bcu_start, bcv_start}) {
-		int y = x;
-		while((parent_bc[y] != -1) && visited[y]) {
-			debug_printf("%d %d\n", y, parent_bc[y]);
-			if( parent_bc[y] == -1) {
-				debug_printf("dafuq...\n");
-			}
-			visited[y] = false;
-			y = parent_bc[y];
-		}
-		visited[y] = false;
-	}
-
-	std::fill(visited.begin(), visited.end(), false);
-
-	for(int i = 0; i < size; i++) {
-		assert( !visited[i] );
-	}
 	return lca;
 }
 
@@ -326,6 +234,7 @@ void IncrementalBridgeConnComponents::evert(int bcu) {
 
 
 void print_union_find(UnionFind& f) {
+#ifndef NDEBUG
 	int n = f.size;
 
 	std::vector<int> size(n,0);
@@ -347,7 +256,6 @@ void print_union_find(UnionFind& f) {
 		}
 		debug_printf("Label: %d\n", i);
 		debug_printf("   Size: %d\n", size[i]);
-		debug_printf("   Rank: %d\n", f.rank[i]);
 		debug_printf("   Members: ");
 		for(auto x : label_list[i]) {
 			debug_printf("%d ", x);
@@ -355,53 +263,93 @@ void print_union_find(UnionFind& f) {
 		debug_printf("\n");
 	}
 	debug_printf("\n");
+#else
+	(void)f;
+#endif
 }
 
 
-bool test_edge(Graph& g, Edge e, int threshold) {
-	Weight orig_weight = e.weight();
-	e.edge_data()->weight = threshold + 1;
+// Bounded nearest terminal queries of test_edge. The distance from every
+// vertex to its nearest terminal is kept in a Voronoi partition of g, which
+// is a lower bound for each query and the exact answer when the path to the
+// nearest terminal avoids the tested edge. Only the remaining queries search
+// the graph, within their radius and on a sparse-reset workspace.
+struct BoundedTerminalSearch {
+	Graph& g;
+	DijkstraWorkspace ws;
+	IncrementalVoronoi<Graph> voronoi;
+	size_t synced_terminals = 0;
+
+	explicit BoundedTerminalSearch(Graph& g) : g(g), ws(g), voronoi(g) {}
+
+	// distance from v to its nearest terminal if it is at most radius, -1
+	// otherwise; e is the tested edge, whose weight is above the radius
+	Weight nearest_terminal(Vertex v, Edge e, Weight radius) {
+		if (voronoi.dist[v] > radius) return -1;
+
+		bool uses_e = false;
+		for (Vertex u = v; voronoi.base[u] != u; u = voronoi.vpred[u].source()) {
+			if (voronoi.vpred[u].index() == e.index()) {
+				uses_e = true;
+				break;
+			}
+		}
+		if (!uses_e) return voronoi.dist[v];
+
+		auto& dist = ws.dist;
+		Weight found = -1;
+		ws.reset();
+		ws.add_source(v);
+		Dijkstra(g, dist, dummy, ws,
+			[&](Vertex v){
+				if (dist[v] > radius) return Visit::Stop;
+				if (g.is_terminal(v)) {
+					found = dist[v];
+					return Visit::Stop;
+				}
+				return Visit::Continue;
+			}
+		);
+		return found;
+	}
 
-	std::vector<Weight> dist(num_vertices(g));
-	Dummy pred_map;
+	// tests edges of one weight class against threshold, in order; the ones
+	// to buy go to out and get their ends marked as terminals
+	template < typename Out >
+	void test_edges(const std::vector<Edge>& edges, int threshold, Out out) {
+		for (auto f : edges) {
+			if (g.terminals.size() != synced_terminals) {
+				voronoi.update();
+				synced_terminals = g.terminals.size();
+			}
+
+			debug_printf("Testing edge (%d,%d) weight %d against threshold %d...",
+				f.source(), f.target(), f.weight(), threshold);
+			if (test_edge(g, f, threshold, *this)) {
+				debug_printf("Marking for buying...");
+				*out++ = f;
+			}
+			debug_printf("Done\n");
+		}
+	}
+};
 
-	const auto cmp = [&](Vertex a, Vertex b) { return dist[a] < dist[b]; };
-	Heap<Vertex, decltype(cmp), std::vector<unsigned>, 4> heap{cmp};
-	heap.map.assign(g.vertex_count, heap.not_in_heap);
+bool test_edge(Graph& g, Edge e, int threshold, BoundedTerminalSearch& search) {
+	Weight orig_weight = e.weight();
+	e.edge_data()->weight = threshold + 1;
 
 	bool success = true;
 
 	threshold -= orig_weight;
 
 	for(Vertex v : { e.source(), e.target() } ) {
-		std::fill(dist.begin(), dist.end(), std::numeric_limits<Weight>::max());
-		bool found_terminal = false;
-		Weight term_dist = 0;
-		while(!heap.empty()) heap.pop();
-		heap.push(v);
-		dist[v] = 0;
-		try {
-			Dijkstra(g, dist, pred_map, heap,
-				[&](Vertex v){
-					if( dist[v] > threshold ) {
-						debug_printf("  terminal not found within %d distance (already reached %d)   ", threshold, dist[v]);
-						throw EarlyTerminate();
-					}
-					if (g.is_terminal(v)) {
-						found_terminal = true;
-						debug_printf("  terminal found within %d distance    ", dist[v]);
-						term_dist = dist[v];
-						throw EarlyTerminate();
-					}
-				}
-			);
-		}
-		catch (EarlyTerminate e) {}
-
-		if(!found_terminal) {
+		Weight term_dist = search.nearest_terminal(v, e, threshold);
+		if(term_dist == -1) {
+			debug_printf("  terminal not found within %d distance   ", threshold);
 			success = false;
 			break;
 		}
+		debug_printf("  terminal found within %d distance    ", term_dist);
 
 		threshold -= term_dist;
 	}
@@ -414,9 +362,9 @@ bool test_edge(Graph& g, Edge e, int threshold) {
 	return success;
 }
 
-
 void terminal_distance_test(Graph& g) {
 	IncrementalBridgeConnComponents inc(num_vertices(g));
+	BoundedTerminalSearch search(g);
 
 	std::vector<Edge> sorted_edges(num_edges(g), null_edge);
 
@@ -448,15 +396,7 @@ void terminal_distance_test(Graph& g) {
 			last_weight = e.weight();
 		}
 
-		std::vector<Edge> removed_bridges = inc.link(e);
-		for(auto f: removed_bridges ) {
-			debug_printf("Testing edge (%d,%d) weight %d against threshold %d...", f.source(), f.target(), f.weight(), e.weight());
-			if(test_edge(g, f, e.weight())) {
-				debug_printf("Marking for buying...");
-				to_buy.push_back(f);
-			}
-			debug_printf("Done\n");
-		}
+		search.test_edges(inc.link(e), e.weight(), std::back_inserter(to_buy));
 	}
 	print_union_find(inc.components);
 	print_union_find(inc.bridge_conn_components);
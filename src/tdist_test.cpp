@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <signal.h>
+#include <random>
+#include <set>
+
+#include "graph.hpp"
+
+volatile sig_atomic_t g_stop_signal = 0;
+
+// Links random edges into IncrementalBridgeConnComponents and checks that
+// the bridges reported as removed are exactly those that stop being bridges,
+// found by brute force. The removed bridges are the tree paths from both
+// ends of the edge up to their lca, so a wrong lca shows up here.
+
+bool connected_without(int n, const std::vector<Edge>& edges, int skip, Vertex s, Vertex t) {
+	std::vector<std::vector<Vertex>> adj(n);
+	for (int i = 0; i < (int)edges.size(); i++) {
+		if (i == skip) continue;
+		adj[edges[i].source()].push_back(edges[i].target());
+		adj[edges[i].target()].push_back(edges[i].source());
+	}
+	std::vector<bool> seen(n, false);
+	std::vector<Vertex> stack{s};
+	seen[s] = true;
+	while (!stack.empty()) {
+		Vertex v = stack.back();
+		stack.pop_back();
+		for (Vertex u : adj[v]) {
+			if (!seen[u]) { seen[u] = true; stack.push_back(u); }
+		}
+	}
+	return seen[t];
+}
+
+std::set<int> bridges(int n, const std::vector<Edge>& edges) {
+	std::set<int> ret;
+	for (int i = 0; i < (int)edges.size(); i++)
+		if (!connected_without(n, edges, i, edges[i].source(), edges[i].target()))
+			ret.insert(edges[i].index());
+	return ret;
+}
+
+int main(int argc, char* argv[]) {
+	int runs = argc > 1 ? atoi(argv[1]) : 3000;
+	std::mt19937 rng(1);
+	int failed = 0;
+
+	for (int run = 0; run < runs; run++) {
+		int n = 2 + rng() % 30;
+		Graph g(n);
+		std::vector<Edge> edges;
+		std::set<std::pair<int, int>> seen;
+		for (int i = 0; i < 2 * n; i++) {
+			int s = rng() % n, t = rng() % n;
+			if (s == t || !seen.insert({std::min(s, t), std::max(s, t)}).second) continue;
+			edges.push_back(g.add_edge(s, t, 1, s, t));
+		}
+
+		PAUSE_DEBUG {
+		IncrementalBridgeConnComponents inc(n);
+		std::vector<Edge> linked;
+		std::set<int> before;
+		for (auto e : edges) {
+			std::vector<Edge> removed = inc.link(e);
+			linked.push_back(e);
+			std::set<int> after = bridges(n, linked);
+
+			std::set<int> expected;
+			for (int i : before) if (!after.count(i)) expected.insert(i);
+			std::set<int> got;
+			for (auto f : removed) got.insert(f.index());
+
+			if (got != expected || got.size() != removed.size()) {
+				failed++;
+				break;
+			}
+			before = after;
+		}
+		}
+	}
+
+	printf("%d of %d runs failed\n", failed, runs);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
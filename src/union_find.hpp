@@ -0,0 +1,70 @@
+#ifndef UNION_FIND_HPP
+#define UNION_FIND_HPP
+
+#include <vector>
+#include <algorithm>
+
+// Union by size with path halving. parent[u] is the parent of u, or minus
+// the size of the class if u is a root; queries do not allocate.
+struct UnionFind {
+	int size;
+
+	int label(int u);
+	int root(int u);
+	bool find(int u, int v);
+	int link(int u, int v);
+
+	int get_size(int u);
+	bool is_root(int u);
+
+	std::vector<int> parent;
+
+	UnionFind(int size);
+};
+
+
+UnionFind::UnionFind(int size) : size(size), parent(size, -1) {}
+
+bool UnionFind::is_root(int u) {
+	return parent[u] < 0;
+}
+
+int UnionFind::root(int u) {
+	while (!is_root(u)) {
+		if (!is_root(parent[u])) parent[u] = parent[parent[u]];
+		u = parent[u];
+	}
+	return u;
+}
+
+int UnionFind::get_size(int u) {
+	return -parent[root(u)];
+}
+
+int UnionFind::label(int u) {
+	return root(u);
+}
+
+
+bool UnionFind::find(int u, int v) {
+	return root(u) == root(v);
+}
+
+int UnionFind::link(int u, int v) {
+	int ur = root(u);
+	int vr = root(v);
+	if(ur == vr) {
+		return ur;
+	}
+
+	if( parent[ur] < parent[vr] ) {
+		std::swap(ur,vr);
+	}
+
+	parent[vr] += parent[ur];
+	parent[ur] = vr;
+
+	return vr;
+}
+
+#endif // UNION_FIND_HPP